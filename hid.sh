@@ -31,11 +31,22 @@ Usage:
 
 Install USB OTG HID keyboard support on Pi Zero, where:
 
+    -f   - use FunctionFS instead of the kernel's HID function, zerohid
+           provides the descriptors and binds the gadget
+    -i uS - poll interval of the HID endpoints, rounded down to a power of
+           2 microframes from 125 uS to 4096000 uS. Needs a kernel whose HID
+           function has the 'interval' attribute, with -f use zerohid -i
+    -k   - use an N-key rollover keyboard report, see zerohid -k
     -m   - also install 3-button mouse support
     -n   - don't re-install if support already exists
+    -s   - high speed profile: 64-byte control endpoint and a 125 uS poll
+           interval unless -i is given, so the host can take up to 8000
+           reports per second where the UDC allows it
     -u   - uninstall existing support
 
-The keyboard device will be at /dev/hidg0, mouse at /dev/hidg1.
+The keyboard device will be at /dev/hidg0, mouse at /dev/hidg1. With -f they
+are FunctionFS mounts at /dev/ffs-keyboard and /dev/ffs-mouse, pass those to
+zerohid instead.
 
 The host view of hid devices is at /sys/kernel/debug/hid/x:x:x:x/rdesc."
 }
@@ -43,21 +54,32 @@ The host view of hid devices is at /sys/kernel/debug/hid/x:x:x:x/rdesc."
 # Also see https://www.kernel.org/doc/Documentation/usb/gadget_configfs.txt
 
 domouse=0
+donkro=0
+doffs=0
+interval=       # uS, or empty for the kernel's default
+maxpacket=0x08  # control endpoint max packet size
 
 install=1 # 0=uninstall, 1=install, 2=conditional install
 
-while getopts ":mnu" c; do case $c in
+while getopts ":fi:kmnsu" c; do case $c in
+    f) doffs=1;;
+    i) interval=$OPTARG;;
+    k) donkro=1;;
     m) domouse=1;;
     n) install=2;;
+    s) maxpacket=0x40; interval=${interval:-125};;
     u) install=0;;
     *) usage;;
 esac; done
+[[ $interval =~ ^[0-9]*$ ]] || usage
 
 
 # Keyboard report descriptor, a report is 8 bytes:
 #   M 0 K1 K2 K3 K4 K5 K6
 # Where 'M' is 8-bit modifier key state, '0' is literal 0, and 'Kx' are up to 6
-# pressed HID key codes (unused slots are 0).
+# pressed HID key codes (unused slots are 0). The host sets the LEDs with a
+# 1-byte output report, bits 0 to 4 are Num Lock, Caps Lock, Scroll Lock,
+# Compose and Kana.
 keyboard=(
     05 01        # USAGE_PAGE (Generic Desktop)
     09 06        # USAGE (Keyboard)
@@ -81,6 +103,49 @@ keyboard=(
     19 00        #     USAGE_MINIMUM (Reserved (no event indicated))
     29 65        #     USAGE_MAXIMUM (Keyboard Application)
     81 00        #     INPUT (Data,Ary,Abs)
+    95 05        #     REPORT_COUNT (5)
+    75 01        #     REPORT_SIZE (1)
+    05 08        #     USAGE_PAGE (LEDs)
+    19 01        #     USAGE_MINIMUM (Num Lock)
+    29 05        #     USAGE_MAXIMUM (Kana)
+    91 02        #     OUTPUT (Data,Var,Abs)
+    95 01        #     REPORT_COUNT (1)
+    75 03        #     REPORT_SIZE (3)
+    91 03        #     OUTPUT (Cnst,Var,Abs)
+    c0           # END_COLLECTION
+)
+
+# N-key rollover keyboard report descriptor, a report is 17 bytes:
+#   M B0 B1 ... B15
+# Where 'M' is 8-bit modifier key state and 'Bx' is a bitmap of pressed HID key
+# codes 0 to 127, key 0 is bit 0 of B0. Hosts that only speak the boot
+# protocol (e.g. BIOS setup screens) won't understand it. The LED output
+# report is the same as above.
+nkro=(
+    05 01        # USAGE_PAGE (Generic Desktop)
+    09 06        # USAGE (Keyboard)
+    A1 01        # COLLECTION (Application)
+    05 07        #     USAGE_PAGE (Keyboard)
+    19 E0        #     USAGE_MINIMUM (Keyboard LeftControl)
+    29 E7        #     USAGE_MAXIMUM (Keyboard Right GUI)
+    15 00        #     LOGICAL_MINIMUM (0)
+    25 01        #     LOGICAL_MAXIMUM (1)
+    75 01        #     REPORT_SIZE (1)
+    95 08        #     REPORT_COUNT (8)
+    81 02        #     INPUT (Data,Var,Abs)
+    19 00        #     USAGE_MINIMUM (Reserved (no event indicated))
+    29 7F        #     USAGE_MAXIMUM (Keyboard Mute)
+    95 80        #     REPORT_COUNT (128)
+    81 02        #     INPUT (Data,Var,Abs)
+    95 05        #     REPORT_COUNT (5)
+    75 01        #     REPORT_SIZE (1)
+    05 08        #     USAGE_PAGE (LEDs)
+    19 01        #     USAGE_MINIMUM (Num Lock)
+    29 05        #     USAGE_MAXIMUM (Kana)
+    91 02        #     OUTPUT (Data,Var,Abs)
+    95 01        #     REPORT_COUNT (1)
+    75 03        #     REPORT_SIZE (3)
+    91 03        #     OUTPUT (Cnst,Var,Abs)
     c0           # END_COLLECTION
 )
 
@@ -128,21 +193,23 @@ mouse=(
 gadget=/sys/kernel/config/usb_gadget/zerohid
 config=$gadget/configs/c.1
 function="$gadget/functions/hid.usb"
+ffs="$gadget/functions/ffs."
 
 if  [ -e $gadget ]; then
     ((install != 2)) || { echo "$gadget is already installed"; exit 0; }
     echo > $gadget/UDC || true
-    rm $config/${function##*/}* || true
+    for m in /dev/ffs-*; do umount $m && rmdir $m || true; done
+    rm $config/${function##*/}* $config/${ffs##*/}* || true
     rmdir $config/strings/0x409 || true
     rmdir $config || true
-    rmdir $function* || true
+    rmdir $function* $ffs* || true
     rmdir $gadget/strings/0x409 || true
     rmdir $gadget || true
     [ -e $gadget ] && die "Couldn't remove existing $gadget"
 fi
 
 if ((install == 0)); then
-    modprobe -r usb_f_hid libcomposite
+    modprobe -r usb_f_hid usb_f_fs libcomposite
     echo "$gadget has been removed"
     exit 0
 fi
@@ -154,7 +221,7 @@ fi
 mkdir -p $gadget
 echo 0x0100 > $gadget/bcdDevice         # Version 1.0.0
 echo 0x0200 > $gadget/bcdUSB            # USB 2.0
-echo 0x08   > $gadget/bMaxPacketSize0   # EP0 max packet size
+echo $maxpacket > $gadget/bMaxPacketSize0 # EP0 max packet size
 echo 0x0104 > $gadget/idProduct         # Multifunction Composite Gadget
 echo 0x1d6b > $gadget/idVendor          # Linux Foundation
 mkdir -p $gadget/strings/0x409
@@ -169,12 +236,44 @@ echo 200 > $config/MaxPower # 200 mA
 mkdir -p $config/strings/0x409
 echo "zerohid" > $config/strings/0x409/configuration
 
+if ((doffs)); then
+    # FunctionFS instances, zerohid writes the descriptors then binds the
+    # gadget to the UDC
+    for f in keyboard $( ((domouse)) && echo mouse); do
+        mkdir -p $ffs$f
+        ln -s $ffs$f $config
+        mkdir -p /dev/ffs-$f
+        mount -t functionfs $f /dev/ffs-$f
+    done
+    echo "$gadget has been installed, waiting for zerohid"
+    exit 0
+fi
+
+# Set endpoint poll interval of hid function $1, if given. The kernel uses the
+# same bInterval for full and high speed, so it's encoded as 2^(n-1) 125 uS
+# microframes for high speed, at full speed it's then n mS.
+setinterval() {
+    [[ $interval ]] || return 0
+    [[ -e $1/interval ]] || { echo "No $1/interval, using the default poll interval" >&2; return 0; }
+    local n=1
+    while ((n < 16 && (125 << n) <= interval)); do ((n++)); done
+    echo $n > $1/interval
+}
+
 # create device /dev/hidg0
 mkdir -p ${function}0
-echo 1 > ${function}0/subclass
-echo 1 > ${function}0/protocol
-echo 8 > ${function}0/report_length     # 8 byte reports
-printf $(printf '\\x%s' ${keyboard[@]}) > ${function}0/report_desc
+if ((donkro)); then
+    echo 0 > ${function}0/subclass      # not boot compatible
+    echo 0 > ${function}0/protocol      # none, only meaningful for boot devices
+    echo 17 > ${function}0/report_length # 17 byte reports
+    printf $(printf '\\x%s' ${nkro[@]}) > ${function}0/report_desc
+else
+    echo 1 > ${function}0/subclass
+    echo 1 > ${function}0/protocol
+    echo 8 > ${function}0/report_length # 8 byte reports
+    printf $(printf '\\x%s' ${keyboard[@]}) > ${function}0/report_desc
+fi
+setinterval ${function}0
 ln -s ${function}0 $config
 
 if ((domouse)); then
@@ -184,6 +283,7 @@ if ((domouse)); then
     echo 1 > ${function}1/protocol
     echo 6 > ${function}1/report_length # 6 byte reports
     printf $(printf '\\x%s' ${mouse[@]}) > ${function}1/report_desc
+    setinterval ${function}1
     ln -s ${function}1 $config
 fi
 
@@ -117,3 +117,6 @@
 #define HID_KP9 0x61                        // or page up
 #define HID_KP0 0x62                        // or insert
 #define HID_KPDOT 0x63                      // or delete
+
+#define HID_102ND 0x64                      // non-US \ and |
+#define HID_COMPOSE 0x65                    // application (menu)
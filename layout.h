@@ -0,0 +1,23 @@
+// Compiled keyboard layout file, created by mklayout and mapped by zerohid -l.
+//
+// Maps Unicode BMP code points to the key strokes that produce them on a
+// particular host keyboard layout. index[] is indexed by the upper byte of the
+// code point and selects one of 'pages' pages of 256 entries, indexed by the
+// lower byte. Page 0 is all zeros, so unmapped code points need no special
+// case. Each entry is up to two strokes, a modifier byte and a scan code. The
+// second stroke is used for dead key sequences, its scan code is 0 if there
+// isn't one. A code point that isn't mapped has scan code 0 in the first
+// stroke.
+//
+// Values are in the byte order of the machine that compiled the file, a
+// mismatch shows up as a bad magic number.
+
+#define LAYOUTMAGIC 0x4C42485AU // "ZHBL" in little-endian
+
+struct layout
+{
+    uint32_t magic;
+    uint16_t pages;
+    uint16_t index[256];
+    uint8_t map[][256][2][2];   // [page][low byte][stroke][modifier, scan code]
+};
@@ -0,0 +1,330 @@
+// MIT License
+//
+// Copyright (c) 2020 Rich Leggitt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Build-time generator for keymap.h, the tables zerohid uses to translate X key
+// syms to HID scan codes and key sym names to key syms. Reads keysymdef.h on
+// stdin and writes keymap.h to stdout:
+//
+//     mkkeys < keysymdef.h > keymap.h
+//
+// Every key sym defined in keysymdef.h is looked up by name in the rules below,
+// printable ASCII key syms (and their Unicode key sym equivalents 0x1000020 to
+// 0x100007e) are mapped per the US keyboard layout. The result is a perfect
+// hash table, any key sym is found with two table reads. All key sym names are
+// put in a second perfect hash table so they can be found with a single string
+// compare.
+
+#define usage() die("Usage: mkkeys < keysymdef.h > keymap.h\n")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hidkeys.h"
+
+// write message to stderr and exit
+#define die(...) ({ fprintf(stderr, __VA_ARGS__); exit(1); })
+
+// Key syms other than printable ASCII, by name without the "XK_" prefix. 'scan'
+// is the 16-bit scan code, the upper byte is set for modifier keys. 'need' is
+// modifiers that must be held to produce the key sym.
+struct { const char *name; uint16_t scan; uint8_t need; } rules[] =
+{
+    { "Return",           HID_ENTER },
+    { "Escape",           HID_ESC },
+    { "BackSpace",        HID_BACKSPACE },
+    { "Tab",              HID_TAB },
+    { "ISO_Left_Tab",     HID_TAB, HID_LSHIFT },
+    { "Caps_Lock",        HID_CAPSLOCK },
+    { "F1",               HID_F1 },
+    { "F2",               HID_F2 },
+    { "F3",               HID_F3 },
+    { "F4",               HID_F4 },
+    { "F5",               HID_F5 },
+    { "F6",               HID_F6 },
+    { "F7",               HID_F7 },
+    { "F8",               HID_F8 },
+    { "F9",               HID_F9 },
+    { "F10",              HID_F10 },
+    { "F11",              HID_F11 },
+    { "F12",              HID_F12 },
+    { "Print",            HID_SYSRQ },
+    { "Sys_Req",          HID_SYSRQ },
+    { "Scroll_Lock",      HID_SCROLLLOCK },
+    { "Pause",            HID_PAUSE },
+    { "Break",            HID_PAUSE },
+    { "Insert",           HID_INSERT },
+    { "Home",             HID_HOME },
+    { "Page_Up",          HID_PAGEUP },
+    { "Delete",           HID_DELETE },
+    { "End",              HID_END },
+    { "Page_Down",        HID_PAGEDOWN },
+    { "Right",            HID_RIGHT },
+    { "Left",             HID_LEFT },
+    { "Down",             HID_DOWN },
+    { "Up",               HID_UP },
+    { "Menu",             HID_COMPOSE },
+    { "Num_Lock",         HID_NUMLOCK },
+    { "KP_Divide",        HID_KPSLASH },
+    { "KP_Multiply",      HID_KPASTERISK },
+    { "KP_Subtract",      HID_KPMINUS },
+    { "KP_Add",           HID_KPPLUS },
+    { "KP_Enter",         HID_KPENTER },
+    { "KP_1",             HID_KP1 },
+    { "KP_End",           HID_KP1 },
+    { "KP_2",             HID_KP2 },
+    { "KP_Down",          HID_KP2 },
+    { "KP_3",             HID_KP3 },
+    { "KP_Page_Down",     HID_KP3 },
+    { "KP_4",             HID_KP4 },
+    { "KP_Left",          HID_KP4 },
+    { "KP_5",             HID_KP5 },
+    { "KP_Begin",         HID_KP5 },
+    { "KP_6",             HID_KP6 },
+    { "KP_Right",         HID_KP6 },
+    { "KP_7",             HID_KP7 },
+    { "KP_Home",          HID_KP7 },
+    { "KP_8",             HID_KP8 },
+    { "KP_Up",            HID_KP8 },
+    { "KP_9",             HID_KP9 },
+    { "KP_Page_Up",       HID_KP9 },
+    { "KP_0",             HID_KP0 },
+    { "KP_Insert",        HID_KP0 },
+    { "KP_Decimal",       HID_KPDOT },
+    { "KP_Delete",        HID_KPDOT },
+
+    // modifier bits go in the high byte
+    { "Control_L",        HID_LCTRL << 8 },
+    { "Shift_L",          HID_LSHIFT << 8 },
+    { "Alt_L",            HID_LALT << 8 },
+    { "Super_L",          HID_LSUPER << 8 },
+    { "Control_R",        HID_RCTRL << 8 },
+    { "Shift_R",          HID_RSHIFT << 8 },
+    { "Alt_R",            HID_RALT << 8 },
+    { "ISO_Level3_Shift", HID_RALT << 8 },
+    { "Super_R",          HID_RSUPER << 8 },
+};
+
+// Printable ASCII on the US keyboard layout, each key's unshifted character
+// and shifted character
+struct { char plain, shifted; uint8_t scan; } ascii[] =
+{
+    { '1', '!', HID_1 }, { '2', '@', HID_2 }, { '3', '#', HID_3 }, { '4', '$', HID_4 },
+    { '5', '%', HID_5 }, { '6', '^', HID_6 }, { '7', '&', HID_7 }, { '8', '*', HID_8 },
+    { '9', '(', HID_9 }, { '0', ')', HID_0 }, { '-', '_', HID_MINUS }, { '=', '+', HID_EQUAL },
+    { '[', '{', HID_LEFTBRACE }, { ']', '}', HID_RIGHTBRACE }, { '\\', '|', HID_BACKSLASH },
+    { ';', ':', HID_SEMICOLON }, { '\'', '"', HID_APOSTROPHE }, { '`', '~', HID_GRAVE },
+    { ',', '<', HID_COMMA }, { '.', '>', HID_DOT }, { '/', '?', HID_SLASH }, { ' ', 0, HID_SPACE },
+};
+
+// The hash function, also written to keymap.h so zerohid uses the same one
+#define KEYHASH(k, seed) ((((uint32_t)(k) ^ (seed)) * 0x9E3779B1u) ^ ((uint32_t)(k) >> 7))
+#define STR(...) #__VA_ARGS__
+#define XSTR(...) STR(__VA_ARGS__)
+
+// FNV-1a hash of a key sym name of len chars, used as the key for the name
+// table. Also written to keymap.h.
+#define NAMEHASH uint32_t namehash(const char *s, int len) { uint32_t h = 2166136261u; while (len--) h = (h ^ (uint8_t)*s++) * 16777619u; return h; }
+NAMEHASH
+
+#define MAXKEYS 1024
+struct { uint32_t sym; uint16_t scan; uint8_t need; } keys[MAXKEYS];
+int nkeys = 0;
+
+#define MAXNAMES 4096
+struct { char *name; uint32_t sym; } names[MAXNAMES];
+int nnames = 0;
+
+// Add a key sym to the table if it isn't there already
+void add(uint32_t sym, uint16_t scan, uint8_t need)
+{
+    for (int i = 0; i < nkeys; i++) if (keys[i].sym == sym) return;
+    if (nkeys == MAXKEYS) die("Too many keys\n");
+    keys[nkeys].sym = sym;
+    keys[nkeys].scan = scan;
+    keys[nkeys].need = need;
+    nkeys++;
+}
+
+// Given an ASCII character add its key sym and Unicode key sym
+void addascii(uint8_t c, uint16_t scan, uint8_t need)
+{
+    add(c, scan, need);
+    add(0x1000000 | c, scan, need);
+}
+
+// Try to build a perfect hash of n values with 1<<bits slots, return false if
+// it can't be done. On success, slot[] holds the index of the value in each
+// slot or -1, and seed[] holds the seed for each bucket.
+bool build(uint32_t *values, int n, int bits, int *slot, int *seed)
+{
+    int slots = 1 << bits, buckets = slots / 4;
+    for (int i = 0; i < slots; i++) slot[i] = -1;
+
+    // bucket each value by its unseeded hash, then place the buckets with the
+    // most values first while there are still plenty of free slots, keeping
+    // the values in each bucket together
+    int bucket[n], order[n], size[buckets];
+    memset(size, 0, sizeof size);
+    for (int k = 0; k < n; k++) size[bucket[k] = KEYHASH(values[k], 0) >> (32 - bits + 2)]++;
+    for (int k = 0; k < n; k++) order[k] = k;
+    #define before(a, b) (size[bucket[a]] > size[bucket[b]] || (size[bucket[a]] == size[bucket[b]] && bucket[a] < bucket[b]))
+    for (int i = 1; i < n; i++)
+        for (int j = i; j && before(order[j], order[j-1]); j--)
+        {
+            int t = order[j];
+            order[j] = order[j-1];
+            order[j-1] = t;
+        }
+
+    for (int i = 0; i < n;)
+    {
+        // order[i] to order[e-1] are the values in one bucket
+        int b = bucket[order[i]], e = i;
+        while (e < n && bucket[order[e]] == b) e++;
+        for (seed[b] = 0;; seed[b]++)
+        {
+            if (seed[b] == 65536) return false;
+            int placed = i;
+            for (; placed < e; placed++)
+            {
+                int s = KEYHASH(values[order[placed]], seed[b]) >> (32 - bits);
+                if (slot[s] >= 0) break;
+                slot[s] = order[placed];
+            }
+            if (placed == e) break;
+            // collision, undo and try the next seed
+            while (placed-- > i) slot[KEYHASH(values[order[placed]], seed[b]) >> (32 - bits)] = -1;
+        }
+        i = e;
+    }
+    for (int b = 0; b < buckets; b++) if (!size[b]) seed[b] = 0;
+    return true;
+}
+
+// Build the smallest perfect hash table for n values that works, return its
+// size in bits. slot and seed are allocated.
+int table(uint32_t *values, int n, int **slot, int **seed)
+{
+    for (int bits = 4;; bits++) if ((1 << bits) >= n)
+    {
+        *slot = realloc(*slot, (1 << bits) * sizeof(int));
+        *seed = realloc(*seed, (1 << (bits - 2)) * sizeof(int));
+        if (build(values, n, bits, *slot, *seed)) return bits;
+    }
+}
+
+// Print seed table for 1<<bits slots
+void seeds(const char *name, int *seed, int bits)
+{
+    printf("static const uint16_t %s[%d] =\n{", name, 1 << (bits - 2));
+    for (int b = 0; b < 1 << (bits - 2); b++) printf("%s%d,", (b % 16) ? " " : "\n    ", seed[b]);
+    printf("\n};\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 1) usage();
+
+    // printable ASCII
+    for (int i = 0; i < sizeof(ascii)/sizeof(ascii[0]); i++)
+    {
+        addascii(ascii[i].plain, ascii[i].scan, 0);
+        if (ascii[i].shifted) addascii(ascii[i].shifted, ascii[i].scan, HID_LSHIFT);
+    }
+    for (int i = 0; i < 26; i++)
+    {
+        addascii('a' + i, HID_A + i, 0);
+        addascii('A' + i, HID_A + i, HID_LSHIFT);
+    }
+
+    // everything else by name
+    char line[256], name[128];
+    unsigned int sym;
+    int defined = 0, found = 0;
+    while (fgets(line, sizeof line, stdin))
+    {
+        if (sscanf(line, "#define XK_%127s 0x%x", name, &sym) != 2) continue;
+        defined++;
+        if (nnames == MAXNAMES) die("Too many names\n");
+        names[nnames].name = strdup(name);
+        names[nnames].sym = sym;
+        nnames++;
+        for (int i = 0; i < sizeof(rules)/sizeof(rules[0]); i++) if (!strcmp(name, rules[i].name))
+        {
+            add(sym, rules[i].scan, rules[i].need);
+            found++;
+        }
+    }
+    if (!defined) die("No key syms found on stdin\n");
+    if (found != sizeof(rules)/sizeof(rules[0])) die("Only found %d of %d named key syms\n", found, (int)(sizeof(rules)/sizeof(rules[0])));
+
+    // key syms
+    uint32_t values[MAXNAMES];
+    int *slot = NULL, *seed = NULL;
+    for (int k = 0; k < nkeys; k++) values[k] = keys[k].sym;
+    int bits = table(values, nkeys, &slot, &seed);
+
+    printf("// Generated by mkkeys from keysymdef.h, do not edit!\n\n");
+    printf("// %d X key syms in a perfect hash table of %d slots. A key sym's bucket is\n", nkeys, 1 << bits);
+    printf("// KEYHASH(sym, 0) >> KEYBUCKETSHIFT, its slot is KEYHASH(sym, keyseed[bucket])\n");
+    printf("// >> KEYSLOTSHIFT. Unused slots have sym 0 (NoSymbol).\n");
+    printf("#define KEYHASH(k, seed) %s\n", XSTR(KEYHASH(k, seed)));
+    printf("#define KEYBUCKETSHIFT %d\n", 32 - bits + 2);
+    printf("#define KEYSLOTSHIFT %d\n\n", 32 - bits);
+    seeds("keyseed", seed, bits);
+    printf("// 'scan' is the 16-bit scan code, upper byte is modifier bit or 0, lower byte\n");
+    printf("// is the scan code or 0. 'need' is modifiers that must be held to produce the\n");
+    printf("// key sym.\n");
+    printf("static const struct { uint32_t sym; uint16_t scan; uint8_t need; } keymap[%d] =\n{\n", 1 << bits);
+    for (int s = 0; s < 1 << bits; s++)
+    {
+        if (slot[s] < 0) printf("    { 0 },\n");
+        else printf("    { 0x%x, 0x%04x, 0x%02x },\n", keys[slot[s]].sym, keys[slot[s]].scan, keys[slot[s]].need);
+    }
+    printf("};\n\n");
+
+    // key sym names, hashed by name
+    for (int n = 0; n < nnames; n++)
+    {
+        values[n] = namehash(names[n].name, strlen(names[n].name));
+        for (int i = 0; i < n; i++) if (values[i] == values[n]) die("%s and %s have the same hash\n", names[i].name, names[n].name);
+    }
+    bits = table(values, nnames, &slot, &seed);
+
+    printf("// %d X key sym names in a perfect hash table of %d slots, found as above\n", nnames, 1 << bits);
+    printf("// with namehash(name) as the key. Unused slots have a NULL name.\n");
+    printf("static %s\n", XSTR(NAMEHASH));
+    printf("#define NAMEBUCKETSHIFT %d\n", 32 - bits + 2);
+    printf("#define NAMESLOTSHIFT %d\n\n", 32 - bits);
+    seeds("nameseed", seed, bits);
+    printf("static const struct { const char *name; uint32_t sym; } keynames[%d] =\n{\n", 1 << bits);
+    for (int s = 0; s < 1 << bits; s++)
+    {
+        if (slot[s] < 0) printf("    { 0 },\n");
+        else printf("    { \"%s\", 0x%x },\n", names[slot[s]].name, names[slot[s]].sym);
+    }
+    printf("};\n");
+    return 0;
+}
@@ -0,0 +1,190 @@
+// MIT License
+//
+// Copyright (c) 2020 Rich Leggitt
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Build-time compiler for keyboard layout files, see layout.h. Reads a layout
+// description on stdin and writes the compiled layout to stdout:
+//
+//     mklayout < layouts/de > layouts/de.kbd
+//
+// Each line of the description is a character followed by one or two key
+// strokes, two for a dead key sequence:
+//
+//     ü   LEFTBRACE
+//     @   Q+altgr
+//     ê   GRAVE E
+//
+// The character is given literally in UTF-8, or as U+XXXX (needed for space).
+// A stroke is a key name from hidkeys.h without the "HID_" prefix, followed by
+// any of +shift, +altgr, +ctrl or +alt. A lower case letter also defines its
+// upper case letter with shift added to the last stroke, unless that's defined
+// separately. A stroke of "none" marks a character that can't be typed, to
+// stop it being implied. Blank lines and lines starting with "//" are ignored.
+
+#define usage() die("Usage: mklayout < layout > layout.kbd\n")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "hidkeys.h"
+#include "layout.h"
+
+// write message to stderr and exit
+#define die(...) ({ fprintf(stderr, __VA_ARGS__); exit(1); })
+
+// Keys that produce characters, by name without the "HID_" prefix
+#define KEY(k) { #k, HID_##k }
+struct { const char *name; uint8_t scan; } keys[] =
+{
+    KEY(A), KEY(B), KEY(C), KEY(D), KEY(E), KEY(F), KEY(G), KEY(H), KEY(I),
+    KEY(J), KEY(K), KEY(L), KEY(M), KEY(N), KEY(O), KEY(P), KEY(Q), KEY(R),
+    KEY(S), KEY(T), KEY(U), KEY(V), KEY(W), KEY(X), KEY(Y), KEY(Z),
+    KEY(1), KEY(2), KEY(3), KEY(4), KEY(5), KEY(6), KEY(7), KEY(8), KEY(9), KEY(0),
+    KEY(ENTER), KEY(ESC), KEY(BACKSPACE), KEY(TAB), KEY(SPACE), KEY(MINUS),
+    KEY(EQUAL), KEY(LEFTBRACE), KEY(RIGHTBRACE), KEY(BACKSLASH), KEY(HASHTILDE),
+    KEY(SEMICOLON), KEY(APOSTROPHE), KEY(GRAVE), KEY(COMMA), KEY(DOT), KEY(SLASH),
+    KEY(102ND), KEY(KPSLASH), KEY(KPASTERISK), KEY(KPMINUS), KEY(KPPLUS),
+    KEY(KPENTER), KEY(KP1), KEY(KP2), KEY(KP3), KEY(KP4), KEY(KP5), KEY(KP6),
+    KEY(KP7), KEY(KP8), KEY(KP9), KEY(KP0), KEY(KPDOT),
+};
+
+struct { const char *name; uint8_t bit; } mods[] =
+{
+    { "shift", HID_LSHIFT },
+    { "altgr", HID_RALT },
+    { "ctrl",  HID_LCTRL },
+    { "alt",   HID_LALT },
+};
+
+uint8_t map[65536][2][2];   // [code point][stroke][modifier, scan code]
+bool defined[65536];        // explicitly defined
+int line = 0;
+
+// Decode one UTF-8 character of string s, return its code point or -1 if
+// there's anything else in s
+int32_t utf8(const char *s)
+{
+    const uint8_t *u = (const uint8_t *)s;
+    if (!strncmp(s, "U+", 2) && s[2])
+    {
+        char *e;
+        long cp = strtol(s + 2, &e, 16);
+        return (*e || cp > 0xffff) ? -1 : cp;
+    }
+    int32_t cp;
+    int more;
+    if (u[0] < 0x80) cp = u[0], more = 0;
+    else if ((u[0] & 0xe0) == 0xc0) cp = u[0] & 0x1f, more = 1;
+    else if ((u[0] & 0xf0) == 0xe0) cp = u[0] & 0x0f, more = 2;
+    else return -1;
+    for (int i = 1; i <= more; i++)
+    {
+        if ((u[i] & 0xc0) != 0x80) return -1;
+        cp = (cp << 6) | (u[i] & 0x3f);
+    }
+    return u[more+1] ? -1 : cp;
+}
+
+// Parse stroke s into stroke[modifier, scan code]
+void stroke(char *s, uint8_t *stroke)
+{
+    char *m = strchr(s, '+');
+    if (m) *m++ = 0;
+    stroke[0] = stroke[1] = 0;
+    for (int k = 0; k < sizeof(keys)/sizeof(keys[0]); k++)
+        if (!strcmp(s, keys[k].name)) stroke[1] = keys[k].scan;
+    if (!stroke[1]) die("Line %d: unknown key '%s'\n", line, s);
+    while (m)
+    {
+        s = m;
+        m = strchr(s, '+');
+        if (m) *m++ = 0;
+        int i;
+        for (i = 0; i < sizeof(mods)/sizeof(mods[0]) && strcmp(s, mods[i].name); i++);
+        if (i == sizeof(mods)/sizeof(mods[0])) die("Line %d: unknown modifier '%s'\n", line, s);
+        stroke[0] |= mods[i].bit;
+    }
+}
+
+// Return the upper case of lower case letter cp, or 0 if it isn't one. Only
+// ASCII and Latin-1 are considered, that covers the layouts we support.
+int32_t upper(int32_t cp)
+{
+    if (cp >= 'a' && cp <= 'z') return cp - 32;
+    if (cp >= 0xe0 && cp <= 0xfe && cp != 0xf7) return cp - 32;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 1) usage();
+
+    char buf[256];
+    int count = 0;
+    while (fgets(buf, sizeof buf, stdin))
+    {
+        line++;
+        char *tok[4];
+        int n = 0;
+        for (char *s = strtok(buf, " \t\r\n"); s && n < 4; s = strtok(NULL, " \t\r\n")) tok[n++] = s;
+        if (!n || !strncmp(tok[0], "//", 2)) continue;
+        if (n < 2 || n > 3) die("Line %d: expected a character and one or two key strokes\n", line);
+        int32_t cp = utf8(tok[0]);
+        if (cp < 0) die("Line %d: '%s' is not a single character\n", line, tok[0]);
+        if (defined[cp]) die("Line %d: U+%04X is already defined\n", line, cp);
+        defined[cp] = true;
+        if (n == 2 && !strcmp(tok[1], "none")) continue;
+        count++;
+        stroke(tok[1], map[cp][0]);
+        if (n == 3) stroke(tok[2], map[cp][1]);
+    }
+    if (!count) die("No characters found on stdin\n");
+
+    // implied upper case letters
+    for (int32_t cp = 0; cp < 65536; cp++)
+    {
+        int32_t uc = upper(cp);
+        if (!defined[cp] || !uc || defined[uc]) continue;
+        memcpy(map[uc], map[cp], sizeof map[cp]);
+        map[uc][map[uc][1][1] ? 1 : 0][0] |= HID_LSHIFT;
+    }
+
+    // page 0 is left empty, the rest are allocated as needed
+    struct layout *layout = calloc(1, offsetof(struct layout, map) + 257 * sizeof layout->map[0]);
+    if (!layout) die("Out of memory\n");
+    layout->magic = LAYOUTMAGIC;
+    layout->pages = 1;
+    for (int hi = 0; hi < 256; hi++)
+    {
+        static const uint8_t empty[256][2][2];
+        if (!memcmp(map[hi << 8], empty, sizeof empty)) continue;
+        layout->index[hi] = layout->pages;
+        memcpy(layout->map[layout->pages++], map[hi << 8], sizeof empty);
+    }
+
+    size_t size = offsetof(struct layout, map) + layout->pages * sizeof layout->map[0];
+    if (fwrite(layout, size, 1, stdout) != 1 || fflush(stdout)) die("Write failed\n");
+    return 0;
+}
@@ -20,10 +20,14 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#define _GNU_SOURCE
+
 #define usage() die("\
 Usage:\n\
 \n\
     zerohid [options] /dev/hidX [/dev/hidX]\n\
+    zerohid [options] /dev/ffs-keyboard [/dev/ffs-mouse]\n\
+    zerohid -c [options] > file\n\
 \n\
 Read key events from stdin and write reports to specified OTG HID device.\n\
 Supports XKB mode and ASCII mode.\n\
@@ -32,16 +36,75 @@ In XKB mode, keyboard and mouse events are read from stdin, one per line,\n\
 and converted to HID key or mouse codes. Key codes are sent to the first\n\
 specified HID device, mouse codes to the second device (if given).\n\
 \n\
+A device that's a directory is a FunctionFS mount created by \"hid.sh -f\",\n\
+zerohid then implements the HID function itself with several reports in\n\
+flight, and binds the gadget once the descriptors are written.\n\
+\n\
 In ASCII mode, individual characters are read from stdin and converted to HID\n\
 key codes.\n\
 \n\
+In binary mode, the same events as XKB mode are read as compact binary frames.\n\
+\n\
+In raw mode, pre-compiled keyboard and mouse reports are read from stdin and\n\
+written to the HID devices without translation. The reports are created by\n\
+running zerohid with -c in any other mode, which writes them to stdout instead.\n\
+\n\
 By default, starts in XKB mode and if an empty line is received switch to ASCII\n\
 mode.\n\
 \n\
+Send SIGUSR1 to dump statistics to stderr, they are also dumped on exit if\n\
+debug is enabled.\n\
+\n\
 Options are:\n\
 \n\
     -a      - start in ASCII mode\n\
+    -b      - binary mode, events are read from stdin as CRC-checked frames,\n\
+              see zerohid.c for the format\n\
+    -c      - compile stdin to a raw report stream on stdout for use with -r,\n\
+              no HID devices are opened\n\
     -d      - write debug messages to stdout\n\
+    -e mS   - drop reports that haven't been written within mS milliseconds,\n\
+              default is 1000, 0 means never\n\
+    -f      - in ASCII mode, hold keys and modifiers between characters to\n\
+              minimize the number of reports sent\n\
+    -i uS   - write at most one report per uS microseconds to each device,\n\
+              merging waiting reports where no key or button transition\n\
+              would be lost. Use the endpoint's poll interval, or \"auto\"\n\
+              to learn it from how fast the host accepts reports. For\n\
+              FunctionFS devices it also sets the endpoint's poll interval,\n\
+              which is otherwise 1 mS\n\
+    -k      - send N-key rollover keyboard reports, the keyboard must have\n\
+              been created with \"hid.sh -k\"\n\
+    -l file - in ASCII mode, read UTF-8 and type it per the host keyboard\n\
+              layout compiled to file by mklayout, e.g. layouts/de.kbd.\n\
+              The default is 7-bit ASCII on a US layout\n\
+    -n      - drop reports while the USB host hasn't configured the gadget,\n\
+              by default they are buffered until it does\n\
+    -o P    - what to do with a new report when the keyboard report queue\n\
+              is full (the mouse queue always coalesces, so it never holds\n\
+              up the keyboard):\n\
+                block    - stop reading stdin until there's room (default)\n\
+                oldest   - drop the oldest queued report\n\
+                newest   - drop the new report\n\
+                coalesce - replace the newest queued report\n\
+    -p R,W  - pin the reader thread to cpu R and the writer thread to cpu W,\n\
+              implies -t\n\
+    -r      - raw mode, stdin is a report stream created by -c\n\
+    -t      - read and decode stdin in a separate thread\n\
+    -u      - read stdin and write hidg devices with io_uring, batching\n\
+              submissions and completions into one syscall per pass of the\n\
+              event loop. Falls back to read() and write() if the kernel\n\
+              doesn't support it\n\
+    -v mS   - in ASCII mode, type VT100/xterm escape sequences for cursor,\n\
+              editing and function keys as the key they represent. A lone\n\
+              ESC is typed if the rest of a sequence doesn't arrive within\n\
+              mS milliseconds\n\
+    -w file - pace the keyboard for slow hosts: tap Num Lock every 32\n\
+              reports and wait for the host's LED report, tuning the\n\
+              interval between reports toward the fastest rate the host\n\
+              acknowledges. Num Lock is tapped again to restore it. The\n\
+              interval is loaded from and saved to file, use one per host.\n\
+              Starts from -i or 1000 uS\n\
     -x      - start in XKB mode, disable switch to ASCII mode\n\
 ")
 
@@ -60,61 +123,105 @@ Options are:\n\
 #include <unistd.h>
 #include <termios.h>
 #include <time.h>
-#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <endian.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+#include <linux/io_uring.h>
 
 #include "hidkeys.h"
 
-// This defines the X11 key code symbols, header file is lifted directly from
-// the X11 distro. The symbol naming isn't super consistent.
-#define XK_LATIN1
-#define XK_MISCELLANY
-#include "keysymdef.h"
+// X key sym to HID scan code table, generated by mkkeys from keysymdef.h, which
+// is lifted directly from the X11 distro
+#include "keymap.h"
+
+#include "layout.h"
 
 // write message to stderr and exit
 #define die(...) ({ fprintf(stderr, __VA_ARGS__); exit(1); })
 
 #define expect(q) ({ if (!(q)) die("Failed expect line %d: %s (%s)\n", __LINE__, #q, strerror(errno)); })
 
-// write debug messages to stdout if enabled
+// write debug messages to stdout if enabled, or to stderr if stdout is the
+// compiled report stream
 bool dodebug = false;
-#define debug(...) ({ if (dodebug) fprintf(stdout, __VA_ARGS__); })
+bool compile = false;   // true = write framed reports to stdout instead of hid devices
+#define debug(...) ({ if (dodebug) fprintf(compile ? stderr : stdout, __VA_ARGS__); })
 
 // Restore saved tty state, invoked by atexit()
 struct termios saveattr;
 static void restore(void) { tcsetattr(0, TCSANOW, &saveattr); }
 
-// Return monotonic milliseconds since boot, wraps after 49 days!
-uint32_t mS(void)
+// Runtime statistics, dumped to stderr on SIGUSR1 and at exit
+struct
+{
+    unsigned long reads;        // number of read() calls that returned data
+    unsigned long bytes;        // total bytes returned by read()
+    unsigned long corrupt;      // bytes discarded while resyncing binary or raw frames
+    unsigned long lost;         // gaps in binary frame sequence numbers
+    unsigned long blocked;      // number of times a hid device wasn't ready
+    unsigned long resumed;      // number of times a blocked hid device accepted a report
+    uint64_t resume;            // total uS spent waiting for blocked devices to accept a report
+    uint64_t maxresume;         // longest wait for a device to accept a report
+    unsigned long expired;      // reports dropped because they passed their deadline
+    unsigned long dropped;      // reports dropped because a queue was full, or by reset
+    unsigned long coalesced;    // reports replaced by a newer report because a queue was full
+    unsigned long backlog[2];   // keyboard and mouse reports written while more were queued
+    uint64_t saturated[2];      // total uS taken to write them, i.e. the host's actual report rate
+    unsigned long limited[2];   // of those, the ones spaced by the -i interval rather than the host
+} stats;
+
+static void showstats(void)
+{
+    fprintf(stderr, "stdin: %lu bytes in %lu reads, %lu bytes/read, %lu corrupt, %lu lost\n",
+        stats.bytes, stats.reads, stats.reads ? stats.bytes/stats.reads : 0, stats.corrupt, stats.lost);
+    fprintf(stderr, "hid: %lu blocked, resume latency %llu uS average, %llu uS max\n",
+        stats.blocked, stats.resumed ? (unsigned long long)stats.resume/stats.resumed : 0ULL,
+        (unsigned long long)stats.maxresume);
+    fprintf(stderr, "queue: %lu expired, %lu dropped, %lu coalesced\n",
+        stats.expired, stats.dropped, stats.coalesced);
+    for (int d = 0; d < 2; d++) if (stats.saturated[d])
+        fprintf(stderr, "%s: %llu reports/S when backed up, over %lu reports%s\n", d ? "mouse" : "keyboard",
+            (unsigned long long)stats.backlog[d] * 1000000 / stats.saturated[d], stats.backlog[d],
+            (stats.limited[d] * 2 > stats.backlog[d]) ? ", limited by -i" : "");
+}
+
+// Set by SIGUSR1, checked wherever we wait
+volatile sig_atomic_t dumpstats = 0;
+static void usr1(int sig) { dumpstats = 1; }
+#define checkstats() ({ if (dumpstats) { dumpstats = 0; showstats(); } })
+
+// Return monotonic microseconds since boot
+uint64_t uS(void)
 {
     struct timespec t;
     expect (!clock_gettime(CLOCK_MONOTONIC, &t));
-    return ((uint32_t)t.tv_sec*1000) + (t.tv_nsec/1000000);
+    return ((uint64_t)t.tv_sec*1000000) + (t.tv_nsec/1000);
 }
 
-// write report of specified size to hid file descriptor. Return 0 on success, -1 if blocked for one second, die if error
+// Write report of specified size to hid file descriptor. Return 0 on success,
+// -1 if the device isn't ready or the gadget isn't connected (errno tells which),
+// die if error. Never blocks.
 int write_hid(int hid, uint8_t *report, int size)
 {
-    uint32_t start = mS();
-
-    while (size > 0)
+    while (true)
     {
-        int sent = write(hid, report, size);
-        if (sent > 0)
-        {
-            report += sent;
-            size -= sent;
-        } else
-        {
-            expect(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-            if (mS() - start > 1000)
-            {
-                debug("hid timeout\n");
-                return -1;
-            }
-            sched_yield();
-        }
+        if (write(hid, report, size) > 0) return 0; // f_hid always takes the whole report
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+        if (errno == ESHUTDOWN || errno == ECONNRESET) return -1;
+        expect(errno == EINTR);
     }
-    return 0;
 }
 
 // Given ASCII character return 16-bit scan code, upper byte is modifier bit or 0, lower byte is the scan code or 0
@@ -257,309 +364,2536 @@ uint16_t a2scan(uint8_t key)
     }
 };
 
-// Given xkb code return 16-bit scan code, upper byte is modifer bit or 0, lower byte is scan code or 0
-uint16_t x2scan(uint16_t key)
+// Given X key sym return 16-bit scan code, upper byte is modifer bit or 0,
+// lower byte is scan code or 0
+uint16_t x2scan(uint32_t key)
 {
-    switch(key)
+    int slot = KEYHASH(key, keyseed[KEYHASH(key, 0) >> KEYBUCKETSHIFT]) >> KEYSLOTSHIFT;
+    return (keymap[slot].sym == key) ? keymap[slot].scan : 0;
+}
+
+// Given X key sym return 16-bit scan code to type it as a character, upper
+// byte is the modifier bits that must be held, lower byte is the scan code or
+// 0. Modifier keys aren't characters.
+uint16_t x2char(uint32_t key)
+{
+    int slot = KEYHASH(key, keyseed[KEYHASH(key, 0) >> KEYBUCKETSHIFT]) >> KEYSLOTSHIFT;
+    if (keymap[slot].sym != key || keymap[slot].scan > 255) return 0;
+    return (keymap[slot].need << 8) | keymap[slot].scan;
+}
+
+// Given X key sym name of len chars, without the XK_ prefix, return its key sym
+// or -1 if not known
+int32_t name2sym(const char *name, int len)
+{
+    uint32_t h = namehash(name, len);
+    int slot = KEYHASH(h, nameseed[KEYHASH(h, 0) >> NAMEBUCKETSHIFT]) >> NAMESLOTSHIFT;
+    const char *s = keynames[slot].name;
+    return (s && !strncmp(s, name, len) && !s[len]) ? keynames[slot].sym : -1;
+}
+
+// Keyboard reports are either the 8 byte boot report:
+//   M 0 K1 K2 K3 K4 K5 K6
+// Where 'M' is the modifier bits and 'Kx' are up to 6 pressed keys, or with -k
+// the 17 byte N-key rollover report:
+//   M B0 B1 ... B15
+// Where 'Bx' is a bitmap of pressed keys, key 0 is bit 0 of B0 and key 127 is
+// bit 7 of B15.
+#define MAXREPORT 17
+bool nkro = false;
+
+// Add key to keyboard report, return false if there's no room
+bool press(uint8_t *report, uint8_t key)
+{
+    if (nkro)
     {
-        case XK_A: case XK_a:                     return HID_A;
-        case XK_B: case XK_b:                     return HID_B;
-        case XK_C: case XK_c:                     return HID_C;
-        case XK_D: case XK_d:                     return HID_D;
-        case XK_E: case XK_e:                     return HID_E;
-        case XK_F: case XK_f:                     return HID_F;
-        case XK_G: case XK_g:                     return HID_G;
-        case XK_H: case XK_h:                     return HID_H;
-        case XK_I: case XK_i:                     return HID_I;
-        case XK_J: case XK_j:                     return HID_J;
-        case XK_K: case XK_k:                     return HID_K;
-        case XK_L: case XK_l:                     return HID_L;
-        case XK_M: case XK_m:                     return HID_M;
-        case XK_N: case XK_n:                     return HID_N;
-        case XK_O: case XK_o:                     return HID_O;
-        case XK_P: case XK_p:                     return HID_P;
-        case XK_Q: case XK_q:                     return HID_Q;
-        case XK_R: case XK_r:                     return HID_R;
-        case XK_S: case XK_s:                     return HID_S;
-        case XK_T: case XK_t:                     return HID_T;
-        case XK_U: case XK_u:                     return HID_U;
-        case XK_V: case XK_v:                     return HID_V;
-        case XK_W: case XK_w:                     return HID_W;
-        case XK_X: case XK_x:                     return HID_X;
-        case XK_Y: case XK_y:                     return HID_Y;
-        case XK_Z: case XK_z:                     return HID_Z;
-        case XK_1: case XK_exclam:                return HID_1;;
-        case XK_2: case XK_at:                    return HID_2;;
-        case XK_3: case XK_numbersign:            return HID_3;;
-        case XK_4: case XK_dollar:                return HID_4;;
-        case XK_5: case XK_percent:               return HID_5;;
-        case XK_6: case XK_asciicircum:           return HID_6;;
-        case XK_7: case XK_ampersand:             return HID_7;;
-        case XK_8: case XK_asterisk:              return HID_8;;
-        case XK_9: case XK_parenleft:             return HID_9;;
-        case XK_0: case XK_parenright:            return HID_0;;
-        case XK_Return:                           return HID_ENTER;;
-        case XK_Escape:                           return HID_ESC;;
-        case XK_BackSpace:                        return HID_BACKSPACE;;
-        case XK_Tab:                              return HID_TAB;;
-        case XK_space:                            return HID_SPACE;;
-        case XK_minus: case XK_underscore:        return HID_MINUS;;
-        case XK_equal: case XK_plus:              return HID_EQUAL;;
-        case XK_braceleft: case XK_bracketleft:   return HID_LEFTBRACE;;
-        case XK_braceright: case XK_bracketright: return HID_RIGHTBRACE;;
-        case XK_backslash: case XK_bar:           return HID_BACKSLASH;;
-        case XK_semicolon: case XK_colon:         return HID_SEMICOLON;;
-        case XK_apostrophe: case XK_quotedbl:     return HID_APOSTROPHE;;
-        case XK_grave: case XK_asciitilde:        return HID_GRAVE;;
-        case XK_comma: case XK_less:              return HID_COMMA;;
-        case XK_period: case XK_greater:          return HID_DOT;;
-        case XK_slash: case XK_question:          return HID_SLASH;;
-        case XK_Caps_Lock:                        return HID_CAPSLOCK;;
-        case XK_F1:                               return HID_F1;;
-        case XK_F2:                               return HID_F2;;
-        case XK_F3:                               return HID_F3;;
-        case XK_F4:                               return HID_F4;;
-        case XK_F5:                               return HID_F5;;
-        case XK_F6:                               return HID_F6;;
-        case XK_F7:                               return HID_F7;;
-        case XK_F8:                               return HID_F8;;
-        case XK_F9:                               return HID_F9;;
-        case XK_F10:                              return HID_F10;;
-        case XK_F11:                              return HID_F11;;
-        case XK_F12:                              return HID_F12;;
-        case XK_Sys_Req :                         return HID_SYSRQ;;
-        case XK_Scroll_Lock:                      return HID_SCROLLLOCK;;
-        case XK_Pause: case XK_Break:             return HID_PAUSE;;
-        case XK_Insert:                           return HID_INSERT;;
-        case XK_Home:                             return HID_HOME;;
-        case XK_Page_Up:                          return HID_PAGEUP;;
-        case XK_Delete:                           return HID_DELETE;;
-        case XK_End:                              return HID_END;;
-        case XK_Page_Down:                        return HID_PAGEDOWN;;
-        case XK_Right:                            return HID_RIGHT;;
-        case XK_Left:                             return HID_LEFT;;
-        case XK_Down:                             return HID_DOWN;;
-        case XK_Up:                               return HID_UP;;
-        case XK_Num_Lock:                         return HID_NUMLOCK;;
-        case XK_KP_Divide:                        return HID_KPSLASH;;
-        case XK_KP_Multiply:                      return HID_KPASTERISK;;
-        case XK_KP_Subtract:                      return HID_KPMINUS;;
-        case XK_KP_Add:                           return HID_KPPLUS;;
-        case XK_KP_Enter:                         return HID_KPENTER;;
-        case XK_KP_1: case XK_KP_End:             return HID_KP1;;
-        case XK_KP_2: case XK_KP_Down:            return HID_KP2;;
-        case XK_KP_3: case XK_KP_Page_Down:       return HID_KP3;;
-        case XK_KP_4: case XK_KP_Left:            return HID_KP4;;
-        case XK_KP_5:                             return HID_KP5;;
-        case XK_KP_6: case XK_KP_Right:           return HID_KP6;;
-        case XK_KP_7: case XK_KP_Home:            return HID_KP7;;
-        case XK_KP_8: case XK_KP_Up:              return HID_KP8;;
-        case XK_KP_9: case XK_KP_Page_Up:         return HID_KP9;;
-        case XK_KP_0: case XK_KP_Insert:          return HID_KP0;;
-        case XK_KP_Decimal: case XK_KP_Delete:    return HID_KPDOT;;
-
-        // modifer bits go in the high byte
-        case XK_Control_L:                        return HID_LCTRL << 8;;
-        case XK_Shift_L:                          return HID_LSHIFT << 8;;
-        case XK_Alt_L:                            return HID_LALT << 8;;
-        case XK_Super_L:                          return HID_LSUPER << 8;;
-        case XK_Control_R:                        return HID_RCTRL << 8;;
-        case XK_Shift_R:                          return HID_RSHIFT << 8;;
-        case XK_Alt_R:                            return HID_RALT << 8;;
-        case XK_Super_R:                          return HID_RSUPER << 8;;
-
-        default: return 0;
-    }
-}
-
-// Return one character from stdin, die if EOF or error
-uint8_t readchar(void)
+        if (key < 128) report[1 + key/8] |= 1 << (key & 7);
+        return true;
+    }
+    for (int slot = 2; slot < 8; slot++)
+    {
+        if (report[slot] == key) return true;   // already there!
+        if (!report[slot])                      // empty slot
+        {
+            report[slot] = key;                 // install the code
+            return true;
+        }
+    }
+    return false;
+}
+
+// Delete key from keyboard report
+void release(uint8_t *report, uint8_t key)
 {
-    while (true)
+    if (nkro)
     {
-        uint8_t c;
-        int r = read(0, &c, 1); // read from stdin
-        if (r == 1) return c;
-        expect(errno == EINTR || errno == EAGAIN);
+        if (key < 128) report[1 + key/8] &= ~(1 << (key & 7));
+        return;
+    }
+    bool del = false;
+    for (int slot = 2; slot < 8; slot++)
+    {
+        if (del) report[slot-1] = report[slot];             // deleting, shift code left one slot
+        else del = (report[slot] == key);                   // not deleting, start at matching code
     }
+    if (del) report[7] = 0;                                 // always delete last slot
+}
+
+// Fill keyboard report with 16-bit scan code (modifier bits and key), return
+// the report
+uint8_t *keys(uint8_t *report, uint16_t scan)
+{
+    memset(report, 0, MAXREPORT);
+    report[0] = scan >> 8;
+    if (scan & 0xff) press(report, scan & 0xff);
+    return report;
 }
 
-// Read a '\n'-terminated line from stdin to given buffer, possibly truncated at specified len-1 (but always 0-terminated).
-// Non-printable chars are ignored, returns size of string 0 to len-1
-int readline(char *s, int len)
+// A hid device and the reports waiting to be written to it. The event loop
+// writes queued reports whenever the device is writable. Each report has a
+// deadline, if it hasn't been written by then it's dropped.
+#define QSIZE 64 // must be a power of 2
+#define FFSDEPTH 4 // reports in flight with the FunctionFS backend
+typedef struct
 {
-    int n = 0;
-    while(true)
+    const char *name;
+    int fd;                     // file descriptor, or -1 if not open
+    int size;                   // report size
+    struct
     {
-        uint8_t c = readchar();
-        if (c == '\n')
+        uint8_t report[MAXREPORT];
+        uint64_t deadline;      // uS, or 0 if none
+    } queue[QSIZE];             // reports waiting to be written
+    unsigned int head, tail;    // free-running, head-tail is the number of queued reports
+    uint64_t blocked;           // uS when the device stopped accepting reports, or 0
+    uint64_t retry;             // uS when to retry after the gadget shut down, or 0
+    uint32_t interval;          // minimum uS between reports, 0 = no limit
+    uint64_t next;              // uS when the next report may be written
+    uint64_t written;           // uS when the last report was written
+    uint8_t last[MAXREPORT];    // last report written
+    bool backed;                // more reports were waiting when the host took the last one
+    uint64_t taken;             // uS when the host took the last report
+    uint32_t events;            // current epoll events
+    bool plain;                 // fd is a plain file, not watched by epoll
+
+    // FunctionFS backend, see ffsopen(). fd is then the interrupt IN endpoint.
+    int ep0;                    // control endpoint, or -1 if fd is a hidg device
+    int wfd;                    // with io_uring, a blocking fd for the same hidg device
+    int lastsqe;                // with io_uring, index of the last write posted but not submitted, or -1
+    unsigned int resend, failed; // with io_uring, reports that were interrupted and must be written again
+    uint64_t due[FFSDEPTH];     // with io_uring, deadline of the report in each buffer, or 0
+    struct __kernel_timespec expires[FFSDEPTH]; // the same, for its linked timeout
+    aio_context_t aio;          // reports in flight on fd
+    int done;                   // eventfd, readable when a report in flight completes
+    int flying;                 // number of reports in flight
+    unsigned int submitted;     // number of reports submitted
+    uint8_t buffer[FFSDEPTH][MAXREPORT]; // one per report in flight
+    uint8_t idle, protocol;     // as set by the host
+} device;
+
+device keyboard = { .name = "keyboard", .fd = -1, .size = 8, .ep0 = -1, .lastsqe = -1, .protocol = 1 };
+device mouse = { .name = "mouse", .fd = -1, .size = 6, .ep0 = -1, .lastsqe = -1, .protocol = 1 };
+
+#define queued(d) ((d)->head - (d)->tail)
+
+// What to do with a new report when the keyboard queue is full. A full mouse
+// queue always coalesces, so a host that stops polling the mouse can't stall
+// the keyboard.
+enum { BLOCK, OLDEST, NEWEST, COALESCE };
+int policy = BLOCK;         // BLOCK = stop decoding input until there is room
+uint32_t expire = 1000;     // report deadline in mS, 0 = none
+
+// Reports can be paced to the endpoint's poll interval, since the host can't
+// see more than one per interval anyway. While a report waits for its slot,
+// newer reports are merged into it where possible. The interval can be given,
+// or learned from how fast the host takes reports when they're backed up.
+// Mouse reports are always merged while the endpoint isn't ready, only the
+// latest position matters so pointer latency stays about one poll interval.
+uint32_t interval = 0;      // uS, 0 = none
+bool learn = false;         // true = learn interval
+
+// Try to merge report into the newest queued report without losing a key or
+// button transition. Mouse positions are replaced by the latest and wheel
+// motion is summed. Return true if merged.
+bool merge(device *d, uint8_t *report)
+{
+    if (!queued(d)) return false;
+    uint8_t *p = (queued(d) > 1) ? d->queue[(d->head-2) & (QSIZE-1)].report : d->last;
+    uint8_t *q = d->queue[(d->head-1) & (QSIZE-1)].report;
+    if (d == &mouse)
+    {
+        // q's position can't move if its buttons changed there
+        int w = (int8_t)q[5] + (int8_t)report[5];
+        if (p[0] != q[0] || q[0] != report[0] || w < -127 || w > 127) return false;
+        memcpy(q, report, 5);
+        q[5] = w;
+        return true;
+    }
+
+    // keyboard, p -> q -> report must not change the same modifier or key twice
+    if ((p[0] ^ q[0]) & (q[0] ^ report[0])) return false;
+    if (nkro)
+    {
+        for (int i = 1; i < d->size; i++) if ((p[i] ^ q[i]) & (q[i] ^ report[i])) return false;
+    }
+    else for (int i = 2; i < 8; i++)
+    {
+        // for each key in p or q...
+        for (int j = 0; j < 2; j++)
         {
-            s[n] = 0;
-            return n;
+            uint8_t key = j ? q[i] : p[i];
+            if (!key) continue;
+            bool inp = memchr(p+2, key, 6), inq = memchr(q+2, key, 6), inr = memchr(report+2, key, 6);
+            if (inp != inq && inq != inr) return false;
         }
-        if (c >= ' ' && c <= '~' && n < len-1) s[n++] = c;
     }
+    memcpy(q, report, d->size);
+    return true;
 }
 
-int main(int argc, char *argv[])
+// Make room in the mouse queue by merging the oldest report that only moves the
+// pointer into the next one, if that doesn't change buttons either. Wheel
+// motion is summed. Return false if there's no such report.
+bool compact(device *d)
+{
+    uint8_t *p = d->last;
+    for (unsigned int i = d->tail; i + 1 != d->head; i++)
+    {
+        uint8_t *a = d->queue[i & (QSIZE-1)].report, *b = d->queue[(i+1) & (QSIZE-1)].report;
+        int w = (int8_t)a[5] + (int8_t)b[5];
+        if (p[0] == a[0] && a[0] == b[0] && w >= -127 && w <= 127)
+        {
+            b[5] = w;
+            for (unsigned int j = i; j != d->tail; j--) d->queue[j & (QSIZE-1)] = d->queue[(j-1) & (QSIZE-1)];
+            d->tail++;
+            return true;
+        }
+        p = a;
+    }
+    return false;
+}
+
+// Gadget state from the UDC, reports are only written while the host has
+// configured it. Until then they're buffered with no deadline, coalescing if
+// the queue fills, or dropped if offline is set.
+bool configured = true;     // stays true if there's no UDC to watch
+uint64_t enumerated = 0;    // uS when the host last configured the gadget
+bool offline = false;       // true = drop reports while not configured
+
+// Closed loop keyboard pacing, with -w. Slow hosts (BIOS screens, remote
+// consoles) can lose keys typed at full speed, so every PROBEEVERY reports the
+// keyboard taps Num Lock and holds further reports until the host's LED output
+// report shows it took the tap. The round trip tunes the keyboard's interval:
+// it shrinks while acks come back about as fast as the quickest seen, grows
+// when they're slow, and doubles when one doesn't come back at all. A second
+// tap follows each one, so the host's LED state is always restored before
+// typing resumes. The interval is loaded from and saved to a profile file,
+// one per target.
+#define PROBEEVERY 32       // reports between probes
+#define ACKWAIT 1000000     // uS to wait for an ack
+#define MAXMISS 3           // stop pacing after this many probes in a row weren't acked
+#define PACEMIN 125         // interval range in uS, from a high speed microframe
+#define PACEMAX 100000
+#define NUMLOCK 0x01        // LED bit
+struct
+{
+    const char *file;       // profile, or NULL if not pacing
+    uint8_t leds;           // LED state last reported by the host
+    uint8_t original;       // Num Lock bit to restore, once known
+    bool known;             // original is known
+    unsigned int count;     // reports written since the last probe
+    bool probing;           // a probe is queued, its release is written when the keyboard's tail reaches mark
+    unsigned int mark;
+    uint64_t sent;          // uS when the probe's tap was written, 0 if not waiting for an ack
+    uint32_t minrtt;        // shortest round trip seen, uS
+    int misses;             // probes in a row that weren't acked
+    bool dirty;             // interval changed since the profile was saved
+} pace;
+
+// Load the pacing profile, or start from the given interval or 1 mS
+void loadpace(void)
 {
-    int mode = 0;            // 0 = xkb with shift to ascii, 1 = xkb only, 2 = ascii
+    keyboard.interval = interval ? interval : 1000;
+    FILE *f = fopen(pace.file, "r");
+    if (!f) return;
+    if (fscanf(f, "%u %u", &keyboard.interval, &pace.minrtt) != 2 ||
+        keyboard.interval < PACEMIN || keyboard.interval > PACEMAX) die("Invalid pacing profile %s\n", pace.file);
+    fclose(f);
+    debug("pace interval %u uS from %s\n", keyboard.interval, pace.file);
+}
 
-    while(true) switch(getopt(argc, argv, ":adx"))
+// Save the pacing profile if it changed
+void savepace(void)
+{
+    if (!pace.file || !pace.dirty) return;
+    FILE *f = fopen(pace.file, "w");
+    if (!f || fprintf(f, "%u %u\n", keyboard.interval, pace.minrtt) < 0 || fclose(f))
     {
-        case 'a': mode = 2; break;
-        case 'd': dodebug = true; break;
-        case 'x': mode = 1; break;
-        case ':':            // missing
-        case '?': usage();   // or invalid options
-        case -1: goto optx;  // no more options
-    } optx:
-    argc -= (optind-1);
-    argv += (optind-1);
-    if (argc < 2 || argc > 3) usage();
+        debug("Can't write %s: %s\n", pace.file, strerror(errno));
+        return;
+    }
+    pace.dirty = false;
+}
+
+// Set the keyboard interval to us, within the pacing range
+static void setpace(uint32_t us)
+{
+    if (us < PACEMIN) us = PACEMIN;
+    if (us > PACEMAX) us = PACEMAX;
+    if (us == keyboard.interval) return;
+    keyboard.interval = us;
+    pace.dirty = true;
+    debug("pace interval %u uS\n", us);
+}
+
+// Queue a probe ahead of any waiting keyboard reports if one's due, i.e. after
+// PROBEEVERY reports or to restore Num Lock, and no keys are held
+void probe(void)
+{
+    static const uint8_t none[MAXREPORT];
+    device *d = &keyboard;
+    if (!pace.file || pace.probing || pace.sent || pace.misses >= MAXMISS || !configured) return;
+    if (pace.count < PROBEEVERY && !(pace.known && (pace.leds & NUMLOCK) != pace.original)) return;
+    if (QSIZE - queued(d) < 2 || memcmp(d->last, none, d->size)) return;
+    uint8_t tap[MAXREPORT] = {0};
+    press(tap, HID_NUMLOCK);
+    d->tail -= 2;
+    memcpy(d->queue[d->tail & (QSIZE-1)].report, tap, d->size);
+    memset(d->queue[(d->tail+1) & (QSIZE-1)].report, 0, d->size);
+    d->queue[d->tail & (QSIZE-1)].deadline = d->queue[(d->tail+1) & (QSIZE-1)].deadline = 0;
+    pace.probing = true;
+    pace.mark = d->tail + 2;
+    pace.count = 0;
+}
+
+// True while a probe is queued or waiting for its ack, or Num Lock is yet to
+// be restored
+bool pacing(void)
+{
+    return pace.probing || pace.sent ||
+           (pace.known && pace.misses < MAXMISS && (pace.leds & NUMLOCK) != pace.original);
+}
+
+// Reports after a probe wait for its ack
+#define awaitingack(d) ((d) == &keyboard && pace.sent && !pace.probing)
 
-    debug("Starting zerohid in %s mode\n", (mode==0)?"auto":(mode==1)?"xkb":"ascii");
+// Keyboard report written, note when the probe's tap has been, the host acks
+// the press, and when its release has been
+static void paced(void)
+{
+    pace.count++;
+    if (!pace.probing) return;
+    if (keyboard.tail == pace.mark - 1) pace.sent = uS();
+    else if (keyboard.tail == pace.mark) pace.probing = false;
+}
 
-    int keyboard = open(argv[1], O_RDWR|O_NONBLOCK);
-    if (keyboard <= 0) die("Can't open %s: %s\n", argv[1], strerror(errno));
+// Reports were dropped from the front of device's queue, if that took any of
+// the probe it's no longer queued
+static void unprobe(device *d)
+{
+    if (d == &keyboard && pace.probing && (int)(d->tail - pace.mark) > -2) pace.probing = false;
+}
 
-    int mouse = 0;
-    if (argc == 3)
+// Host output report with LED state, the ack if a probe is waiting for one
+void ledreport(uint8_t leds)
+{
+    pace.leds = leds;
+    if (!pace.sent) return;
+    uint32_t rtt = uS() - pace.sent;
+    pace.sent = 0;
+    pace.misses = 0;
+    if (!pace.known)
     {
-        mouse = open(argv[2], O_RDWR|O_NONBLOCK);
-        if (mouse <= 0) die("Can't open %s: %s\n", argv[2], strerror(errno));
+        // the tap toggled it
+        pace.original = (leds ^ NUMLOCK) & NUMLOCK;
+        pace.known = true;
     }
+    if (!pace.minrtt || rtt < pace.minrtt) pace.minrtt = rtt;
+    debug("pace ack %u uS\n", rtt);
+    if (rtt <= 2 * pace.minrtt + keyboard.interval) setpace(keyboard.interval - keyboard.interval / 8);
+    else setpace(keyboard.interval + keyboard.interval / 4);
+}
 
-    if (isatty(0))
+// Time out the probe, if it's waiting for an ack. Return when to check again,
+// or 0.
+uint64_t ackwait(uint64_t now)
+{
+    if (!pace.sent) return 0;
+    if (now < pace.sent + ACKWAIT) return pace.sent + ACKWAIT;
+    pace.sent = 0;
+    setpace(keyboard.interval * 2);
+    if (++pace.misses == MAXMISS) debug("pace stopped, the host doesn't answer Num Lock\n");
+    return 0;
+}
+
+// Return the deadline of a report queued on device at uS now, or 0 if none.
+// Paced keyboard reports don't expire, waiting is the point.
+static uint64_t expiry(device *d, uint64_t now)
+{
+    return (expire && !(d == &keyboard && pace.file)) ? now + expire*1000ULL : 0;
+}
+
+// Add report to device queue, apply the overflow policy if it's full
+void enqueue(device *d, uint8_t *report)
+{
+    if (d->fd < 0) return; // not open
+    if (!configured)
     {
-        // put stdin tty in raw mode
-        struct termios t;
-        expect(!tcgetattr(0, &t));          // get current
-        saveattr = t;                       // save a copy
-        t.c_lflag &= ~(ICANON|ECHO|ISIG);   // make raw
-        t.c_cc[VMIN] = 1;
-        t.c_cc[VTIME] = 0;
-        tcsetattr(0, TCSANOW, &t);
-        atexit(restore);                    // restore tty on exit
+        if (offline)
+        {
+            stats.dropped++;
+            return;
+        }
+        if (queued(d) == QSIZE)
+        {
+            // keep the latest state
+            stats.coalesced++;
+            d->head--;
+        }
+    }
+    else if ((d->interval || learn || d == &mouse) && !(d == &keyboard && pace.probing && d->head == pace.mark) &&
+             merge(d, report)) // not into a probe
+    {
+        stats.coalesced++;
+        d->queue[(d->head-1) & (QSIZE-1)].deadline = expiry(d, uS());
+        return;
+    }
+    else if (queued(d) == QSIZE && d == &mouse)
+    {
+        // never wait for the mouse, make room by merging motion
+        stats.coalesced++;
+        if (!compact(d)) d->head--;
+    }
+    else if (queued(d) == QSIZE) switch(policy)
+    {
+        case OLDEST: stats.dropped++; d->tail++; unprobe(d); break; // drop the oldest
+        case NEWEST: stats.dropped++; return;                       // drop this one
+        case COALESCE: stats.coalesced++; d->head--; break;         // replace the newest
+        default: die("Queue overflow\n");                          // caller should have checked
     }
+    unsigned int i = d->head++ & (QSIZE-1);
+    memcpy(d->queue[i].report, report, d->size);
+    d->queue[i].deadline = expiry(d, uS());
+}
+
+// Drop all queued reports
+void purge(device *d)
+{
+    stats.dropped += queued(d);
+    d->tail = d->head;
+    unprobe(d);
+}
+
+// Make room for a reset whatever the overflow policy: drop everything queued
+// if the device is blocked, else the oldest report if the queue is full, e.g.
+// because of the interval
+void resetroom(device *d)
+{
+    if (d->blocked) purge(d);
+    else if (queued(d) == QSIZE)
+    {
+        stats.dropped++;
+        d->tail++;
+        unprobe(d);
+    }
+}
+
+// The host took a report from d at now, more is true if another was already
+// waiting for it, queued or in flight. Time from one to the next when one was
+// waiting is the host's report rate, unless it's the interval given with -i.
+void taken(device *d, uint64_t now, bool more)
+{
+    if (d->backed)
+    {
+        uint64_t gap = now - d->taken;
+        stats.backlog[d == &mouse]++;
+        stats.saturated[d == &mouse] += gap;
+        if (d->interval && !learn && !pace.file && gap < d->interval + d->interval/8) stats.limited[d == &mouse]++;
+    }
+    d->backed = more;
+    d->taken = now;
+}
+
+// A mouse glide, the pointer is moved from x0,y0 to x1,y1 over duration uS,
+// holding buttons. The event loop generates a report per step from a periodic
+// timerfd, at the mouse's poll interval if known. Mouse reports and glides
+// that arrive meanwhile wait their turn, so e.g. a click after a glide lands
+// where the glide ends. If too many are waiting the glide skips to its end.
+#define GLIDESTEP 4000 // uS per step if the interval isn't known, f_hid's full speed default
+#define GLIDEQ 16 // must be a power of 2
+enum { LINEAR, EASE, EASEIN, EASEOUT };
+typedef struct
+{
+    uint8_t buttons;
+    uint8_t curve;              // LINEAR, EASE (in and out), EASEIN or EASEOUT
+    uint16_t x0, y0, x1, y1;
+    uint32_t duration;          // uS, 0 if not a glide
+} path;
 
-    if (mode < 2) while(true)
+path glide;                     // the current glide
+uint64_t glidestart = 0;        // uS when it started, 0 if not gliding
+int glidetimer = -1;
+struct
+{
+    path glide;                 // a glide, if glide.duration
+    uint8_t report[MAXREPORT];  // else a mouse report
+} later[GLIDEQ];                // waiting for the current glide to end
+unsigned int laterhead = 0, latertail = 0; // free-running, head-tail is the number waiting
+
+// Arm the glide timer to fire every step uS, or disarm if 0
+static void glidearm(uint32_t step)
+{
+    struct timespec t = { .tv_sec = step / 1000000, .tv_nsec = (step % 1000000) * 1000 };
+    expect(!timerfd_settime(glidetimer, 0, &(struct itimerspec){ .it_interval = t, .it_value = t }, NULL));
+}
+
+// Start glide p. If the buttons change they change at the start position.
+static void startglide(path *p)
+{
+    uint8_t *q = queued(&mouse) ? mouse.queue[(mouse.head-1) & (QSIZE-1)].report : mouse.last;
+    if (q[0] != p->buttons)
+        enqueue(&mouse, (uint8_t []){p->buttons, p->x0 & 255, p->x0 >> 8, p->y0 & 255, p->y0 >> 8, 0});
+    glide = *p;
+    glidestart = uS();
+    glidearm(mouse.interval ? mouse.interval : GLIDESTEP);
+}
+
+// Send the glide's report for now, or for its end if skip is true. When it
+// ends, pass on whatever was waiting until that starts another glide.
+void glidestep(bool skip)
+{
+    double t = skip ? 1 : (uS() - glidestart) / (double)glide.duration, e;
+    if (t >= 1) t = 1;
+    switch (glide.curve)
+    {
+        case EASE: e = t*t*(3 - 2*t); break;
+        case EASEIN: e = t*t; break;
+        case EASEOUT: e = t*(2 - t); break;
+        default: e = t; break;
+    }
+    uint16_t X = glide.x0 + (glide.x1 - glide.x0) * e + 0.5;
+    uint16_t Y = glide.y0 + (glide.y1 - glide.y0) * e + 0.5;
+    enqueue(&mouse, (uint8_t []){glide.buttons, X & 255, X >> 8, Y & 255, Y >> 8, 0});
+    if (t < 1) return;
+    debug("glide %s\n", skip ? "skipped" : "done");
+    glidestart = 0;
+    glidearm(0);
+    while (laterhead != latertail && !glidestart)
+    {
+        unsigned int i = latertail++ & (GLIDEQ-1);
+        if (later[i].glide.duration) startglide(&later[i].glide);
+        else enqueue(&mouse, later[i].report);
+    }
+}
+
+// Pass a mouse report, or glide p if not NULL, to the mouse queue, unless it
+// has to wait for a glide
+void mousing(uint8_t *report, path *p)
+{
+    if (mouse.fd < 0) return;
+    if (glidestart)
     {
-        // The input is text, one event per line
-        char s[32];
-        int got = readline(s, sizeof s);
-        if (got == 0) // empty line?
+        if (laterhead - latertail == GLIDEQ) glidestep(true);
+        if (glidestart)
         {
-            if (mode)
+            unsigned int i = laterhead++ & (GLIDEQ-1);
+            if (p) later[i].glide = *p;
+            else
             {
-                debug("xkb ignore null input\n");
-                continue;
+                later[i].glide.duration = 0;
+                memcpy(later[i].report, report, mouse.size);
             }
-            debug("xkb switch to ascii\n");
-            break;  // break to the ascii loop below
+            return;
         }
+    }
+    if (p) startglide(p);
+    else enqueue(&mouse, report);
+}
+
+// Decoded reports, passed from the reader thread to the main thread through a
+// lock-free single-producer/single-consumer ring. Head is only written by the
+// reader and tail only by the main thread. When one side has to wait for the
+// other it sets its waiting flag and sleeps (the reader on an eventfd, the
+// main thread in epoll), the other side pokes the eventfd after it next moves
+// head or tail.
+typedef struct
+{
+    device *dev;                // destination device
+    bool reset;                 // this is a keyboard reset
+    uint8_t report[MAXREPORT];
+    path glide;                 // or a mouse glide, if glide.duration
+} event;
+
+#define EVSIZE 256 // must be a power of 2
+struct
+{
+    event ev[EVSIZE];
+    atomic_uint head, tail;     // free-running, head-tail is the number of events in the ring
+    atomic_bool readerwait;     // reader is waiting for space
+    atomic_bool writerwait;     // main thread is waiting for events
+    atomic_bool eof;            // reader reached EOF on stdin
+    atomic_uint resets;         // number of resets pushed, see reset()
+    int space, ready;           // eventfds to wake the reader and the main thread
+} evring;
+
+bool threaded = false;          // true if stdin is read and decoded by a separate thread
+bool useuring = false;          // true = try io_uring, see uringsetup()
+
+// Sleep on eventfd until poked
+static void evsleep(int fd)
+{
+    uint64_t n;
+    while (read(fd, &n, sizeof n) != sizeof n) expect(errno == EINTR);
+}
+
+// Poke the eventfd if the other side is waiting
+static void evwake(atomic_bool *waiting, int fd)
+{
+    if (atomic_exchange(waiting, false)) expect(write(fd, &(uint64_t){1}, 8) == 8);
+}
+
+// Queue a report, or a glide if not NULL, for the main thread. Wait for space
+// if the ring is full.
+void push(device *dev, uint8_t *report, bool reset, path *glide)
+{
+    unsigned int head = atomic_load_explicit(&evring.head, memory_order_relaxed);
+    while (head - atomic_load(&evring.tail) == EVSIZE)
+    {
+        atomic_store(&evring.readerwait, true);
+        if (head - atomic_load(&evring.tail) == EVSIZE) evsleep(evring.space);
+        atomic_store(&evring.readerwait, false);
+    }
+    event *e = &evring.ev[head & (EVSIZE-1)];
+    e->dev = dev;
+    e->reset = reset;
+    if (glide) e->glide = *glide;
+    else
+    {
+        e->glide.duration = 0;
+        memcpy(e->report, report, dev->size);
+    }
+    atomic_store_explicit(&evring.head, head + 1, memory_order_release);
+    evwake(&evring.writerwait, evring.ready);
+}
 
-        if (s[0] == '+' || s[0] == '-' || s[0] == '!')
+// Move events from the ring to the device queues, until the ring is empty or
+// the keyboard queue is full and policy is BLOCK. Return true if the ring is
+// empty. If a reset is in the ring and the keyboard is blocked, keyboard
+// events ahead of it are dropped.
+bool pull(void)
+{
+    static unsigned int resets = 0; // resets pulled so far
+    unsigned int tail = atomic_load_explicit(&evring.tail, memory_order_relaxed);
+    while (tail != atomic_load_explicit(&evring.head, memory_order_acquire))
+    {
+        event *e = &evring.ev[tail & (EVSIZE-1)];
+        if (e->reset)
         {
-            static uint8_t report[8] = {0}; // last sent report
-            if (s[0] == '!')
-            {
-                debug("xkb reset\n");
-                memset(report, 0, sizeof report);
-            } else
-            {
-                // payload is a decimal X key sym
-                uint16_t key;
-                int n;
-                if (sscanf(s+1, "%hu %n", &key, &n) != 1 || s[n+1]) goto invalid;
-
-                uint16_t scan = x2scan(key);
-                debug("xkb %d => %d\n", key, scan);
-                if (!scan) continue; // nothing to do!
-                if (s[0] == '+')
-                {
-                    // key pressed
-                    if (scan > 255)
-                        // Set modifier bit
-                        report[0] |= scan >> 8;
-                    else
-                    {
-                        // Add key to first empty report slot
-                        int slot = 2;
-                        for (; slot < sizeof report; slot++)
-                        {
-                            if (report[slot] == (scan & 0xff)) break; // already there!
-                            if (!report[slot])                        // empty slot
-                            {
-                                report[slot] = scan & 0xff;           // install the code and break
-                                break;
-                            }
-                        }
-                        if (slot == sizeof report)
-                        {
-                            // oops, send overflow in all slots
-                            debug("xkb overflow!\n");
-                            write_hid(keyboard, (uint8_t[]){report[0], 0, HID_OVF, HID_OVF, HID_OVF, HID_OVF, HID_OVF, HID_OVF}, 8);
-                            continue;
-                        }
-                    }
-                } else
-                {
-                    // Key released
-                    if (scan > 255)
-                        // Reset modifier bit
-                        report[0] &= ~(scan >> 8);
-                    else
-                    {
-                        // Delete scancode from report
-                        bool del = false;
-                        for (int slot = 2; slot < sizeof report; slot++)
-                        {
-                            if (del) report[slot-1] = report[slot];             // deleting, shift code left one slot
-                            else del = (report[slot] == (scan & 0xff));         // not deleting, start at matching code
-                        }
-                        if (del) report[7] = 0;                                 // always delete last slot
-                    }
-                }
-            }
-            // send key report
-            write_hid(keyboard, report, 8);
-        }
-        else if (s[0] >= '0' && s[0] <= '7')
-        {
-            // Mouse event, code is the 3-bit button state. Payload is:
-            //   "XXXXX YYYYY [-]WWW"
-            // Decimal-encoded absolute X 0-32767, Y 0-32767, relative wheel
-            // -127 to +127.
-            if (!mouse) debug("xkb ignore mouse event\n");
-            uint16_t X, Y;
-            int8_t W = 0;
-            int n;
-            int r = sscanf(s+1, "%hu %hu %hhd %n", &X, &Y, &W, &n);
-            if (r != 3 || X > 32767 || Y > 32767 || W < -127 || s[n+1]) goto invalid;
-            debug("xkb mouse buttons=%c X=%u Y=%u W=%d\n", s[0], X, Y, W);
-            write_hid(mouse, (uint8_t []){s[0]-'0', X & 255, X >> 8, Y & 255, Y >> 8, W}, 6); // little endian!
+            resets++;
+            resetroom(e->dev);
+            enqueue(e->dev, e->report);
         }
+        else if (e->dev == &keyboard && e->dev->blocked && resets != atomic_load(&evring.resets))
+            stats.dropped++;
+        else if (e->glide.duration) mousing(NULL, &e->glide);
         else
         {
-            invalid:
-            if (dodebug)
-            {
-                // dump line in hex
-                fprintf(stderr, "xkb invalid:");
-                for (int i = 0; i < got; i++) fprintf(stderr," %02X", s[i]);
-                fprintf(stderr, "\n");
-            }
+            if (policy == BLOCK && configured && e->dev == &keyboard && queued(e->dev) == QSIZE) return false;
+            if (e->dev == &mouse) mousing(e->report, NULL);
+            else enqueue(e->dev, e->report);
         }
+        atomic_store_explicit(&evring.tail, ++tail, memory_order_release);
+        evwake(&evring.readerwait, evring.space);
     }
+    return true;
+}
+
+// Send a report to the hid device, either directly to its queue or via the
+// main thread. If compiling, write it to stdout as a raw report frame.
+void send(device *dev, uint8_t *report)
+{
+    if (compile)
+    {
+        putchar(dev == &mouse);
+        putchar(dev->size);
+        fwrite(report, dev->size, 1, stdout);
+        return;
+    }
+    if (threaded) push(dev, report, false, NULL);
+    else
+    {
+        if (dev == &mouse) mousing(report, NULL);
+        else enqueue(dev, report);
+    }
+}
+
+// Release all keys. If the keyboard is blocked, any reports still queued for
+// it are dropped so the reset is sent as soon as possible, see resetroom().
+void reset(void)
+{
+    uint8_t report[MAXREPORT] = {0};
+    if (threaded)
+    {
+        atomic_fetch_add(&evring.resets, 1);
+        push(&keyboard, report, true, NULL);
+    } else
+    {
+        resetroom(&keyboard);
+        enqueue(&keyboard, report);
+    }
+}
+
+// Most reports the decoder sends for one character or line, an unrecognized
+// escape sequence typed as ESC and a dead key sequence
+#define MAXSEND 6
+
+// Return true if the decoder can send another character or line worth of
+// reports
+bool room(void)
+{
+    if (threaded || policy != BLOCK || !configured) return true; // push() waits, or enqueue() makes room
+    return QSIZE - queued(&keyboard) >= MAXSEND; // the mouse queue never blocks
+}
+
+// Input ring buffer, filled from stdin with as many bytes as are available in
+// a single read(). inhead and intail are free-running, inhead-intail is the
+// number of bytes in the buffer.
+#define INSIZE 4096 // must be a power of 2
+uint8_t inring[INSIZE];
+unsigned int inhead = 0, intail = 0;
+
+// Return number of unread bytes in the input ring
+#define pending() (inhead - intail)
 
-    // Here, input is raw ASCII chars
+// Read whatever stdin has into the input ring, blocking until at least one
+// byte arrives if nothing is available. Return false if EOF, die if error.
+bool fill(void)
+{
     while (true)
     {
-        uint8_t key = readchar();
-        uint16_t scan = a2scan(key);
-        debug("ascii %02X => %04X\n", key, scan);
-        if (!write_hid(keyboard, (uint8_t[]){scan >> 8, 0, scan & 0xff, 0, 0, 0, 0, 0}, 8))   // press
-            write_hid(keyboard, (uint8_t[]){0, 0, 0, 0, 0, 0, 0, 0}, 8);                      // release
+        // read into the contiguous free space after inhead
+        unsigned int offset = inhead & (INSIZE-1);
+        unsigned int space = INSIZE - pending();
+        if (space > INSIZE - offset) space = INSIZE - offset;
+        if (!space) return true;                    // ring is full
+        int r = read(0, inring + offset, space);    // read from stdin
+        if (r > 0)
+        {
+            inhead += r;
+            stats.reads++;
+            stats.bytes += r;
+            return true;
+        }
+        if (!r) return false;
+        expect(errno == EINTR || errno == EAGAIN);
+        if (errno == EAGAIN) return true;
+        checkstats();
+    }
+}
+
+int mode = 0;               // 0 = xkb with shift to ascii, 1 = xkb only, 2 = ascii, 3 = binary, 4 = raw
+bool fast = false;          // true = minimize ascii reports
+
+// Last keyboard report sent in xkb or binary mode
+uint8_t pressed[MAXREPORT] = {0};
+
+// Press (down = true) or release the key for X key sym in report, a copy of
+// the pressed report, without sending it. Return 1 if the report needs to be
+// sent, 0 if the key sym has no scan code, or -1 if there's no room to press
+// another key, in which case the overflow report has been sent instead.
+int xchange(uint8_t *report, bool down, uint32_t key)
+{
+    uint16_t scan = x2scan(key);
+    debug("xkb %u => %d\n", key, scan);
+    if (!scan) return 0; // nothing to do!
+    if (down)
+    {
+        // key pressed
+        if (scan > 255)
+            // Set modifier bit
+            report[0] |= scan >> 8;
+        else if (!press(report, scan & 0xff))
+        {
+            // oops, send overflow in all slots, with the modifiers the host has
+            debug("xkb overflow!\n");
+            send(&keyboard, (uint8_t[]){pressed[0], 0, HID_OVF, HID_OVF, HID_OVF, HID_OVF, HID_OVF, HID_OVF});
+            return -1;
+        }
+    } else
+    {
+        // Key released
+        if (scan > 255)
+            // Reset modifier bit
+            report[0] &= ~(scan >> 8);
+        else
+            release(report, scan & 0xff);
+    }
+    return 1;
+}
+
+// Press (down = true) or release the key for X key sym and send the report
+void xkey(bool down, uint32_t key)
+{
+    if (xchange(pressed, down, key) > 0) send(&keyboard, pressed);
+}
+
+// Type X key sym as a character. Press its key with the modifiers it needs
+// and any others held except shift, then release it and restore the held
+// modifiers, two reports in all. If the key was already held it's released
+// first.
+void xtype(uint32_t key)
+{
+    uint16_t scan = x2char(key);
+    debug("xkb type %u => %04X\n", key, scan);
+    if (!scan) return; // nothing to do!
+
+    uint8_t report[MAXREPORT];
+    memcpy(report, pressed, MAXREPORT);
+    release(pressed, scan & 0xff);
+    if (memcmp(report, pressed, MAXREPORT)) send(&keyboard, pressed);
+
+    memcpy(report, pressed, MAXREPORT);
+    report[0] = (report[0] & ~(HID_LSHIFT|HID_RSHIFT)) | (scan >> 8);
+    if (!press(report, scan & 0xff))
+    {
+        debug("xkb overflow!\n");
+        return;
+    }
+    send(&keyboard, report);
+    send(&keyboard, pressed);
+}
+
+// Release all keys
+void xreset(void)
+{
+    debug("xkb reset\n");
+    memset(pressed, 0, sizeof pressed);
+    reset();
+}
+
+uint16_t mouseX = 0, mouseY = 0; // where the decoder last put the pointer, glides start here
+
+// Send mouse report with 3-bit button state, absolute X and Y 0-32767 and
+// relative wheel -127 to 127
+void xmouse(uint8_t buttons, uint16_t X, uint16_t Y, int8_t W)
+{
+    if (mouse.fd < 0) debug("xkb ignore mouse event\n");
+    debug("xkb mouse buttons=%u X=%u Y=%u W=%d\n", buttons, X, Y, W);
+    mouseX = X;
+    mouseY = Y;
+    send(&mouse, (uint8_t []){buttons, X & 255, X >> 8, Y & 255, Y >> 8, W}); // little endian!
+}
+
+// Glide the pointer to X, Y over mS milliseconds holding buttons, easing per
+// curve. The intermediate reports are generated by the event loop. When
+// compiling, only the final position is written since raw reports carry no
+// timing.
+void xglide(uint8_t buttons, uint16_t X, uint16_t Y, uint16_t mS, uint8_t curve)
+{
+    if (!mS || compile)
+    {
+        xmouse(buttons, X, Y, 0);
+        return;
+    }
+    if (mouse.fd < 0) debug("xkb ignore mouse event\n");
+    debug("xkb glide buttons=%u X=%u Y=%u mS=%u curve=%u\n", buttons, X, Y, mS, curve);
+    path p = { .buttons = buttons, .curve = curve, .x0 = mouseX, .y0 = mouseY, .x1 = X, .y1 = Y, .duration = mS * 1000 };
+    mouseX = X;
+    mouseY = Y;
+    if (threaded) push(&mouse, NULL, false, &p);
+    else mousing(NULL, &p);
+}
+
+#define LINESIZE 64 // longest xkb line, including the terminating null
+
+// Parse a decimal number in the range min to max at *s, skipping spaces before
+// and after it. Only a negative range allows a leading '-'. Return true and
+// advance *s past it if valid.
+bool decimal(char **s, int32_t min, int32_t max, int32_t *value)
+{
+    char *p = *s;
+    while (*p == ' ') p++;
+    bool neg = (*p == '-' && min < 0);
+    p += neg;
+    if (*p < '0' || *p > '9') return false;
+    int64_t n = 0;
+    for (int i = 0; *p >= '0' && *p <= '9'; i++)
+    {
+        if (i == 10) return false; // too many digits
+        n = n*10 + (*p++ - '0');
     }
+    if (neg) n = -n;
+    if (n < min || n > max) return false;
+    while (*p == ' ') p++;
+    *s = p;
+    *value = n;
+    return true;
+}
+
+// Parse an X key sym at *s, in decimal or by its name in keysymdef.h without
+// the XK_ prefix, skipping spaces before and after it. Return true and advance
+// *s past it if valid.
+bool keysym(char **s, int32_t *key)
+{
+    char *p = *s;
+    while (*p == ' ') p++;
+    int len = strspn(p, "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_");
+    if (strspn(p, "0123456789") >= len) return decimal(s, 0, 0x1fffffff, key);
+    // it's a name
+    if ((*key = name2sym(p, len)) < 0) return false;
+    p += len;
+    while (*p == ' ') p++;
+    *s = p;
+    return true;
+}
+
+// Process one line of xkb input
+void xkb(char *s, int got)
+{
+    if (got == 0) // empty line?
+    {
+        if (mode)
+        {
+            debug("xkb ignore null input\n");
+            return;
+        }
+        debug("xkb switch to ascii\n");
+        mode = 2;
+        return;
+    }
+
+    if (s[0] == '!') xreset();
+    else if (s[0] == '+' || s[0] == '-')
+    {
+        // One or more transitions, each is '+' or '-' followed by an X key
+        // sym, in decimal or by its name in keysymdef.h without the XK_
+        // prefix, e.g. "+65507+65513+65535" or "+Control_L +Alt_L +Delete".
+        // They are all applied and sent as a single report, so the host never
+        // sees a partial chord. The whole line is checked, and applied to a
+        // copy of the pressed report that's only kept if every transition
+        // fits, before anything is sent.
+        struct { bool down; int32_t key; } chord[LINESIZE/2];
+        int count = 0;
+        for (char *p = s; *p; count++)
+        {
+            chord[count].down = (*p == '+');
+            if (*p != '+' && *p != '-') goto invalid;
+            p++;
+            if (!keysym(&p, &chord[count].key)) goto invalid;
+        }
+        uint8_t next[MAXREPORT];
+        memcpy(next, pressed, MAXREPORT);
+        bool changed = false;
+        for (int i = 0; i < count; i++)
+        {
+            int r = xchange(next, chord[i].down, chord[i].key);
+            if (r < 0) return;
+            changed |= r;
+        }
+        memcpy(pressed, next, MAXREPORT);
+        if (changed) send(&keyboard, pressed);
+    }
+    else if (s[0] == '=')
+    {
+        // '=' followed by an X key sym, in decimal or by name, to type as a
+        // character with whatever modifiers it needs, e.g. "=exclam" or "=33"
+        // types '!'
+        int32_t key;
+        char *p = s+1;
+        if (!keysym(&p, &key) || *p) goto invalid;
+        xtype(key);
+    }
+    else if (s[0] >= '0' && s[0] <= '7')
+    {
+        // Mouse event, code is the 3-bit button state. Payload is:
+        //   "XXXXX YYYYY [-]WWW"
+        // Decimal-encoded absolute X 0-32767, Y 0-32767, relative wheel
+        // -127 to +127.
+        int32_t X, Y, W;
+        char *p = s+1;
+        if (!decimal(&p, 0, 32767, &X) || !decimal(&p, 0, 32767, &Y) || !decimal(&p, -127, 127, &W) || *p) goto invalid;
+        xmouse(s[0]-'0', X, Y, W);
+    }
+    else if (s[0] == '>')
+    {
+        // Mouse glide, '>' then the button state to hold and:
+        //   "XXXXX YYYYY MMMMM [C]"
+        // Glide to absolute X 0-32767, Y 0-32767 over M 0-65535 mS. C is the
+        // easing curve, 0 = linear, 1 = ease in and out (default), 2 = ease
+        // in, 3 = ease out.
+        int32_t B, X, Y, M, C = EASE;
+        char *p = s+1;
+        if (!decimal(&p, 0, 7, &B) || !decimal(&p, 0, 32767, &X) || !decimal(&p, 0, 32767, &Y) ||
+            !decimal(&p, 0, 65535, &M) || (*p && !decimal(&p, 0, 3, &C)) || *p) goto invalid;
+        xglide(B, X, Y, M, C);
+    }
+    else
+    {
+        invalid:
+        if (dodebug)
+        {
+            // dump line in hex
+            fprintf(stderr, "xkb invalid:");
+            for (int i = 0; i < got; i++) fprintf(stderr," %02X", s[i]);
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+// Binary mode, each event is a frame of 2 to 9 bytes:
+//
+//   H [payload] C
+//
+// Where 'H' is the frame type in the upper 4 bits and a sequence number in the
+// lower 4 bits, incremented for each frame sent. 'C' is the CRC-8 (polynomial
+// 0x07, initial value 0) of 'H' and the payload. Frame types are:
+//
+//   0x0 - release all keys, no payload
+//   0x1 - key press, payload is the X key sym as a varint
+//   0x2 - key release, payload is the X key sym as a varint
+//   0x3 - mouse wheel, payload is signed 8-bit wheel -127 to 127, buttons and
+//         position are unchanged from the previous mouse frame
+//   0x4 - type character, payload is the X key sym as a varint, see xtype()
+//   0x5 - mouse glide, payload is the button state to hold in the lower 3
+//         bits and the easing curve in the upper 4 bits of one byte, then
+//         absolute X and Y 0-32767 and the duration in mS, each 16-bit little
+//         endian. See the xkb '>' line.
+//   0x8 to 0xF - mouse position, lower 3 bits of the type are the button
+//         state, payload is absolute X then Y 0-32767, each 16-bit little
+//         endian
+//
+// A varint is 7 bits per byte, least significant first, the top bit is set on
+// all but the last byte.
+//
+// A frame with bad CRC or unknown type is discarded one byte at a time until a
+// valid frame is found. A gap in the sequence numbers means frames were lost,
+// all keys are released since a lost key release would otherwise leave the
+// key stuck down.
+
+// Return CRC-8 of size bytes
+uint8_t crc8(uint8_t *data, int size)
+{
+    uint8_t crc = 0;
+    while (size--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) crc = (crc << 1) ^ ((crc & 0x80) ? 0x07 : 0);
+    }
+    return crc;
+}
+
+// Given the first got bytes of a frame, return the size of the whole frame
+// including CRC, 0 if more bytes are needed to tell, or -1 if not a valid frame
+int framesize(uint8_t *f, int got)
+{
+    switch (f[0] >> 4)
+    {
+        case 0x0: return 2;
+        case 0x1:
+        case 0x2:
+        case 0x4:
+            for (int i = 1; i < got; i++)
+            {
+                if (!(f[i] & 0x80)) return i+2;
+                if (i == 5) return -1; // more than 32 bits
+            }
+            return 0;
+        case 0x3: return 3;
+        case 0x5: return 9;
+        case 0x8 ... 0xF: return 6;
+    }
+    return -1;
+}
+
+// Process one valid binary frame
+void frame(uint8_t *f, int size)
+{
+    static int seq = -1; // expected sequence number, -1 if unknown
+    if (seq >= 0 && (f[0] & 15) != seq)
+    {
+        debug("binary lost %d frames\n", ((f[0] & 15) - seq) & 15);
+        stats.lost++;
+        if (f[0] >> 4) xreset(); // unless this is a reset anyway
+    }
+    seq = (f[0] + 1) & 15;
+
+    static uint8_t buttons = 0;
+    static uint16_t X = 0, Y = 0;
+    switch (f[0] >> 4)
+    {
+        case 0x0: xreset(); break;
+        case 0x1:
+        case 0x2:
+        case 0x4:
+        {
+            uint32_t key = 0;
+            for (int i = 1; i < size-1; i++) key |= (uint32_t)(f[i] & 0x7f) << (7*(i-1));
+            if ((f[0] >> 4) == 0x4) xtype(key);
+            else xkey((f[0] >> 4) == 0x1, key);
+            break;
+        }
+        case 0x3:
+            if ((int8_t)f[1] < -127) goto invalid;
+            xmouse(buttons, X, Y, f[1]);
+            break;
+        case 0x5:
+        {
+            uint16_t x = f[2] | (f[3] << 8), y = f[4] | (f[5] << 8);
+            if ((f[1] & 0x08) || (f[1] >> 4) > EASEOUT || x > 32767 || y > 32767) goto invalid;
+            buttons = f[1] & 7;
+            X = x;
+            Y = y;
+            xglide(buttons, X, Y, f[6] | (f[7] << 8), f[1] >> 4);
+            break;
+        }
+        default:
+        {
+            uint16_t x = f[1] | (f[2] << 8), y = f[3] | (f[4] << 8);
+            if (x > 32767 || y > 32767) goto invalid;
+            buttons = (f[0] >> 4) & 7;
+            X = x;
+            Y = y;
+            xmouse(buttons, X, Y, 0);
+            break;
+        }
+    }
+    return;
+
+    invalid:
+    debug("binary invalid frame type %X\n", f[0] >> 4);
+}
+
+// Raw mode, each report is pre-compiled into a frame:
+//
+//   D L R1 R2 ... RL
+//
+// Where 'D' is the device, 0 for the keyboard or 1 for the mouse, and 'L' is
+// the report size, which must match the device, followed by the report itself.
+// Reports are sent as is. A frame with unknown device or wrong size is
+// discarded one byte at a time until a valid frame is found. Frames are
+// created with "zerohid -c".
+void raw(uint8_t c)
+{
+    static uint8_t f[2 + MAXREPORT];
+    static int got = 0;
+
+    f[got++] = c;
+    while (got)
+    {
+        device *dev = f[0] ? &mouse : &keyboard;
+        if (f[0] > 1 || (got > 1 && f[1] != dev->size))
+        {
+            // resync, discard first byte and try again
+            stats.corrupt++;
+            memmove(f, f+1, --got);
+            continue;
+        }
+        if (got < 2 + dev->size) return; // need more
+        if (dev->fd >= 0) send(dev, f+2);
+        got = 0;
+    }
+}
+
+// Process one byte of binary input
+void binary(uint8_t c)
+{
+    static uint8_t f[9];
+    static int got = 0;
+
+    f[got++] = c;
+    while (got)
+    {
+        int size = framesize(f, got);
+        if (!size || size > got) return; // need more
+        if (size > 0 && crc8(f, size-1) == f[size-1])
+        {
+            frame(f, size);
+            got -= size;
+            memmove(f, f+size, got);
+        } else
+        {
+            // resync, discard first byte and try again
+            stats.corrupt++;
+            memmove(f, f+1, --got);
+        }
+    }
+}
+
+// Fast ASCII, the key and modifiers for each character are held until the
+// next character arrives, then replaced in a single report. The host sees the
+// old key released and the new key pressed. A release is only required if the
+// same key is typed twice in a row, or when the input runs dry.
+uint16_t held = 0; // modifier and key the host currently sees
+
+// Type 16-bit scan code in ASCII mode
+void type(uint16_t scan)
+{
+    uint8_t report[MAXREPORT];
+    if (!fast)
+    {
+        send(&keyboard, keys(report, scan));    // press
+        send(&keyboard, keys(report, 0));       // release
+        return;
+    }
+    if (!scan) return;
+    if ((held & 0xff) == (scan & 0xff))
+        // same key again, release it but keep the modifiers
+        send(&keyboard, keys(report, held & 0xff00));
+    send(&keyboard, keys(report, scan));
+    held = scan;
+}
+
+// In fast ASCII mode, release whatever the host sees held
+void letgo(void)
+{
+    if (!held) return;
+    uint8_t report[MAXREPORT];
+    send(&keyboard, keys(report, 0));
+    held = 0;
+}
+
+// With -v, VT100/xterm escape sequences for cursor, editing and function keys
+// are typed as the single key they represent. The bytes of a partial sequence
+// are kept in esc[] until it's complete, or until escwait mS pass without it
+// completing, in which case the ESC is typed as is, followed by the bytes
+// after it from vtrest[].
+uint32_t escwait = 0;       // mS to wait for the rest of an escape sequence, 0 = don't decode them
+uint64_t escdeadline = 0;   // uS when to stop waiting, 0 if not waiting
+uint8_t esc[16];
+int escgot = 0;
+uint8_t vtrest[sizeof esc]; // bytes after a timed out ESC, typed as there's room
+int vtnext = 0, vtlen = 0;
+#define vtleft() (vtnext < vtlen)
+
+// Modifier bits for xterm modifier parameter m, 1 + shift 1, alt 2, control
+// 4, meta 8
+#define vtmods(m) ( ((((m)-1) & 1) ? HID_LSHIFT : 0) | ((((m)-1) & 2) ? HID_LALT : 0) | \
+                    ((((m)-1) & 4) ? HID_LCTRL : 0) | ((((m)-1) & 8) ? HID_LSUPER : 0) )
+
+// Given got bytes of a possible escape sequence starting with ESC, return the
+// 16-bit scan code of its key, -1 if more bytes are needed, -2 if it's not an
+// escape sequence after all, or 0 if it's not one we know
+int vtkey(uint8_t *s, int got)
+{
+    if (got < 3) return (got == 2 && s[1] != '[' && s[1] != 'O') ? -2 : -1;
+
+    if (s[1] == 'O')
+    {
+        // SS3, application cursor and keypad keys, and F1-F4
+        switch (s[2])
+        {
+            case 'A': return HID_UP;
+            case 'B': return HID_DOWN;
+            case 'C': return HID_RIGHT;
+            case 'D': return HID_LEFT;
+            case 'H': return HID_HOME;
+            case 'F': return HID_END;
+            case 'P': return HID_F1;
+            case 'Q': return HID_F2;
+            case 'R': return HID_F3;
+            case 'S': return HID_F4;
+            case 'M': return HID_KPENTER;
+            case 'j': return HID_KPASTERISK;
+            case 'k': return HID_KPPLUS;
+            case 'm': return HID_KPMINUS;
+            case 'n': return HID_KPDOT;
+            case 'o': return HID_KPSLASH;
+            case 'p': return HID_KP0;
+            case 'q' ... 'y': return HID_KP1 + s[2] - 'q';
+        }
+        return 0;
+    }
+
+    // CSI
+    if (s[2] == '[')
+    {
+        // linux console F1-F5
+        if (got == 3) return -1;
+        return (s[3] >= 'A' && s[3] <= 'E') ? HID_F1 + s[3] - 'A' : 0;
+    }
+
+    // parameter and intermediate bytes are 0x20 to 0x3f, up to the final byte
+    // 0x40 to 0x7e. The parameters we know are decimal numbers separated by
+    // ';'.
+    uint8_t final = s[got-1];
+    if (final >= 0x20 && final <= 0x3f) return -1;
+    if (final < 0x40 || final > 0x7e) return 0;
+    int param[2] = {0, 1}, n = 0;
+    for (int i = 2; i < got-1; i++)
+    {
+        if (s[i] == ';')
+        {
+            if (++n > 1) return 0;
+            param[n] = 0;
+        }
+        else if (s[i] >= '0' && s[i] <= '9')
+        {
+            param[n] = param[n]*10 + s[i] - '0';
+            if (param[n] > 99) return 0; // none are this big, and it can't overflow
+        }
+        else return 0;
+    }
+    if (param[1] < 1 || param[1] > 16) return 0;
+    uint16_t mods = vtmods(param[1]) << 8;
+
+    switch (final)
+    {
+        case 'A': return mods | HID_UP;
+        case 'B': return mods | HID_DOWN;
+        case 'C': return mods | HID_RIGHT;
+        case 'D': return mods | HID_LEFT;
+        case 'H': return mods | HID_HOME;
+        case 'F': return mods | HID_END;
+        case 'P': return mods | HID_F1;
+        case 'Q': return mods | HID_F2;
+        case 'R': return mods | HID_F3;
+        case 'S': return mods | HID_F4;
+        case 'Z': return shift(HID_TAB);
+        case '~':
+            switch (param[0])
+            {
+                case 1: case 7: return mods | HID_HOME;
+                case 2: return mods | HID_INSERT;
+                case 3: return mods | HID_DELETE;
+                case 4: case 8: return mods | HID_END;
+                case 5: return mods | HID_PAGEUP;
+                case 6: return mods | HID_PAGEDOWN;
+                case 11 ... 15: return mods | (HID_F1 + param[0] - 11);
+                case 17 ... 21: return mods | (HID_F6 + param[0] - 17);
+                case 23: return mods | HID_F11;
+                case 24: return mods | HID_F12;
+            }
+    }
+    return 0;
+}
+
+// With -l, the layout file is mapped here and characters are decoded from
+// UTF-8. A partial character is kept in ucode until uneed more continuation
+// bytes arrive.
+const struct layout *layout = NULL;
+uint32_t ucode = 0;
+int uneed = 0;
+
+// Map compiled layout file, see layout.h
+void loadlayout(const char *file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) die("Can't open %s: %s\n", file, strerror(errno));
+    struct stat st;
+    expect(!fstat(fd, &st));
+    size_t size = offsetof(struct layout, map);
+    if (st.st_size < size) die("%s is not a layout file\n", file);
+    layout = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+    expect(layout != MAP_FAILED);
+    close(fd);
+    if (layout->magic != LAYOUTMAGIC || !layout->pages ||
+        st.st_size != size + layout->pages * sizeof layout->map[0]) die("%s is not a layout file\n", file);
+    for (int i = 0; i < 256; i++) if (layout->index[i] >= layout->pages) die("%s is corrupt\n", file);
+}
+
+// Type Unicode code point cp per the layout. Control letters are typed with
+// the layout's letter key, anything else the layout doesn't have per
+// a2scan().
+void utype(uint32_t cp)
+{
+    uint32_t c = (cp >= 1 && cp <= 26 && cp != 8 && cp != 9 && cp != 10) ? cp + 'a' - 1 : cp;
+    const uint8_t (*k)[2] = layout->map[(c >> 16) ? 0 : layout->index[c >> 8]][c & 0xff];
+    if (!k[0][1])
+    {
+        uint16_t scan = (cp < 128) ? a2scan(cp) : 0;
+        debug("utf8 %04X => %04X\n", cp, scan);
+        type(scan);
+        return;
+    }
+    uint16_t scan = ((k[0][0] | ((c != cp) ? HID_LCTRL : 0)) << 8) | k[0][1];
+    if (!k[1][1])
+    {
+        debug("utf8 %04X => %04X\n", cp, scan);
+        type(scan);
+        return;
+    }
+    debug("utf8 %04X => %04X %04X\n", cp, scan, (k[1][0] << 8) | k[1][1]);
+    type(scan);                             // dead key
+    type((k[1][0] << 8) | k[1][1]);
+}
+
+// Process one ASCII character, or UTF-8 byte with -l
+void ascii(uint8_t key)
+{
+    if (escwait && (escgot || key == 27))
+    {
+        esc[escgot++] = key;
+        int scan = vtkey(esc, escgot);
+        if (scan == -1 && escgot < sizeof esc)
+        {
+            if (escgot == 1) escdeadline = uS() + escwait*1000ULL;
+            return; // need more
+        }
+        int got = escgot;
+        escgot = 0;
+        escdeadline = 0;
+        if (scan == -2)
+        {
+            // type the ESC and process the next character normally
+            debug("vt not a sequence\n");
+            type(a2scan(27));
+            ascii(esc[1]);
+        }
+        else if (scan > 0)
+        {
+            debug("vt sequence of %d => %04X\n", got, scan);
+            type(scan);
+        }
+        else debug("vt unknown sequence of %d\n", got);
+        return;
+    }
+
+    if (layout)
+    {
+        if (uneed && (key & 0xc0) == 0x80)
+        {
+            ucode = (ucode << 6) | (key & 0x3f);
+            if (!--uneed) utype(ucode);
+            return;
+        }
+        if (uneed) debug("utf8 dropped partial character\n");
+        uneed = 0;
+        if (key >= 0xc0 && key < 0xf8)
+        {
+            // lead byte
+            uneed = (key >= 0xf0) ? 3 : (key >= 0xe0) ? 2 : 1;
+            ucode = key & (0x3f >> uneed);
+        }
+        else if (key >= 0x80) debug("utf8 invalid %02X\n", key);
+        else utype(key);
+        return;
+    }
+
+    uint16_t scan = a2scan(key);
+    debug("ascii %02X => %04X\n", key, scan);
+    type(scan);
+}
+
+// Type ESC if it's been waiting for the rest of an escape sequence for too
+// long, or at EOF if now is true, then the bytes that followed it as normal
+// input while there's room. At EOF nothing follows, so in fast mode the last
+// key is released too.
+void vtflush(bool now)
+{
+    if (escdeadline && !vtleft() && (now || uS() >= escdeadline))
+    {
+        debug("vt timeout\n");
+        memcpy(vtrest, esc, escgot);
+        vtnext = 1;
+        vtlen = escgot;
+        escgot = 0;
+        escdeadline = 0;
+        type(a2scan(27));
+    }
+    while (vtleft() && room()) ascii(vtrest[vtnext++]);
+    if (now && !vtleft() && !escdeadline) letgo();
+}
+
+// True if all 8 bytes of w are printable, i.e. none are less than ' ' or
+// greater than '~'
+#define ONES 0x0101010101010101ULL
+#define printable(w) (!((((w) - ONES*' ') | ((w) + ONES*(127-'~')) | (w)) & ONES*0x80))
+
+// Append the printable chars of size bytes at p to line s, which already
+// has got chars, truncating at LINESIZE-1. Return the new length. Runs of 8
+// printable chars are checked and copied as one word.
+int append(char *s, int got, uint8_t *p, unsigned int size)
+{
+    while (size)
+    {
+        uint64_t w;
+        if (size >= 8 && got <= LINESIZE-1-8 && (memcpy(&w, p, 8), printable(w)))
+        {
+            memcpy(s+got, &w, 8);
+            got += 8;
+            p += 8;
+            size -= 8;
+        } else
+        {
+            if (*p >= ' ' && *p <= '~' && got < LINESIZE-1) s[got++] = *p;
+            p++;
+            size--;
+        }
+    }
+    return got;
+}
+
+// Decode the input ring until it's empty or there's no room for more reports.
+// In xkb mode the input is text, one event per line, a partial line is kept
+// until the rest arrives. Non-printable chars are ignored and long lines are
+// truncated.
+void decode(void)
+{
+    static char s[LINESIZE];
+    static int got = 0;
+
+    if ((escdeadline || vtleft()) && room()) vtflush(false);
+
+    while (pending() && room())
+    {
+        if (mode >= 2)
+        {
+            uint8_t c = inring[intail++ & (INSIZE-1)];
+            if (mode == 2) ascii(c);
+            else if (mode == 3) binary(c);
+            else raw(c);
+            continue;
+        }
+
+        // xkb, find the end of line in the contiguous part of the ring with
+        // memchr, which libc vectorizes
+        uint8_t *p = inring + (intail & (INSIZE-1));
+        unsigned int size = pending();
+        if (size > INSIZE - (intail & (INSIZE-1))) size = INSIZE - (intail & (INSIZE-1));
+        uint8_t *nl = memchr(p, '\n', size);
+        if (nl) size = nl - p;
+        got = append(s, got, p, size);
+        intail += size;
+        if (nl)
+        {
+            intail++;
+            s[got] = 0;
+            xkb(s, got);
+            got = 0;
+        }
+    }
+
+    if (!pending() && !vtleft()) letgo(); // nothing buffered
+}
+
+// Reader thread, decode stdin until EOF
+void *reader(void *unused)
+{
+    while (true)
+    {
+        if (escdeadline)
+        {
+            // wait for the rest of an escape sequence, or time out
+            int64_t wait = escdeadline - uS();
+            if (wait < 0 || !poll(&(struct pollfd){ .fd = 0, .events = POLLIN }, 1, wait/1000 + 1))
+            {
+                decode();
+                continue;
+            }
+        }
+        if (!fill()) break;
+        decode();
+    }
+    while (escdeadline || vtleft()) vtflush(true); // an ESC among the bytes replayed starts a new sequence
+    atomic_store(&evring.eof, true);
+    expect(write(evring.ready, &(uint64_t){1}, 8) == 8);
+    return NULL;
+}
+
+// Add, modify or delete epoll events for fd. Return false if fd is a plain
+// file, which epoll can't watch but is always ready anyway.
+bool watch(int ep, int op, int fd, uint32_t events)
+{
+    if (!epoll_ctl(ep, op, fd, &(struct epoll_event){ .events = events, .data.fd = fd })) return true;
+    expect(op == EPOLL_CTL_ADD && errno == EPERM);
+    return false;
+}
+
+// FunctionFS backend. Instead of the kernel's f_hid, zerohid implements the
+// HID function itself: it provides the descriptors, answers the HID class
+// requests on the control endpoint, and writes reports to the interrupt
+// endpoint with AIO so up to FFSDEPTH are in flight at once. Each device is
+// its own FunctionFS instance, created and mounted by "hid.sh -f". The
+// endpoint's poll interval is set from -i, 1 mS by default.
+
+#define GADGET "/sys/kernel/config/usb_gadget/zerohid" // as created by hid.sh
+
+// Report descriptors, the same as hid.sh's
+static const uint8_t bootdesc[] =
+{
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x03, 0x95, 0x06, 0x75, 0x08,
+    0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0x95, 0x05, 0x75, 0x01,
+    0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x03, 0xC0,
+};
+static const uint8_t nkrodesc[] =
+{
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x19, 0x00, 0x29, 0x7F, 0x95, 0x80, 0x81, 0x02, 0x95, 0x05,
+    0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x03,
+    0xC0,
+};
+static const uint8_t mousedesc[] =
+{
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+    0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x00, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81,
+    0x02, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06, 0xC0, 0xC0,
+};
+
+// Return device's report descriptor and its size
+static const uint8_t *reportdesc(device *d, int *size)
+{
+    if (d == &mouse) return *size = sizeof mousedesc, mousedesc;
+    if (nkro) return *size = sizeof nkrodesc, nkrodesc;
+    return *size = sizeof bootdesc, bootdesc;
+}
+
+// HID class descriptor
+struct hiddesc
+{
+    uint8_t bLength, bDescriptorType;
+    uint16_t bcdHID;
+    uint8_t bCountryCode, bNumDescriptors, bReportType;
+    uint16_t wReportLength;
+} __attribute__((packed));
+
+// Return the HID class descriptor for device
+static struct hiddesc hiddesc(device *d)
+{
+    int size;
+    reportdesc(d, &size);
+    return (struct hiddesc){ 9, 0x21, htole16(0x0111), 0, 1, 0x22, htole16(size) };
+}
+
+static long io_setup(unsigned n, aio_context_t *ctx) { return syscall(__NR_io_setup, n, ctx); }
+static long io_submit(aio_context_t ctx, long n, struct iocb **iocbs) { return syscall(__NR_io_submit, ctx, n, iocbs); }
+static long io_getevents(aio_context_t ctx, long min, long max, struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min, max, events, timeout);
+}
+
+// Set up device as FunctionFS instance mounted at dir: write its descriptors
+// and strings to ep0, then open the interrupt endpoint
+void ffsopen(device *d, const char *dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/ep0", dir);
+    d->ep0 = open(path, O_RDWR);
+    if (d->ep0 < 0) die("Can't open %s: %s\n", path, strerror(errno));
+
+    // full and high speed descriptors, the interval is in frames and in
+    // 2^(n-1) microframes respectively
+    uint32_t us = interval ? interval : 1000;
+    uint8_t fs = (us < 1000) ? 1 : (us > 255000) ? 255 : us / 1000, hs = 1;
+    while (hs < 16 && (125U << hs) <= us) hs++;
+    struct
+    {
+        struct usb_interface_descriptor intf;
+        struct hiddesc hid;
+        struct usb_endpoint_descriptor_no_audio ep;
+    } __attribute__((packed)) fn =
+    {
+        .intf = { .bLength = sizeof fn.intf, .bDescriptorType = USB_DT_INTERFACE, .bNumEndpoints = 1,
+                  .bInterfaceClass = USB_CLASS_HID, .bInterfaceSubClass = (d == &keyboard && !nkro),
+                  .bInterfaceProtocol = (d == &keyboard && !nkro), .iInterface = 1 },
+        .hid = hiddesc(d),
+        .ep = { .bLength = sizeof fn.ep, .bDescriptorType = USB_DT_ENDPOINT, .bEndpointAddress = 1 | USB_DIR_IN,
+                .bmAttributes = USB_ENDPOINT_XFER_INT, .wMaxPacketSize = htole16(d->size) },
+    };
+    struct
+    {
+        struct usb_functionfs_descs_head_v2 head;
+        uint32_t fs_count, hs_count;
+        typeof(fn) fs, hs;
+    } __attribute__((packed)) descs =
+    {
+        .head = { htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2), htole32(sizeof descs),
+                  htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC) },
+        .fs_count = htole32(3), .hs_count = htole32(3), .fs = fn, .hs = fn,
+    };
+    descs.fs.ep.bInterval = fs;
+    descs.hs.ep.bInterval = hs;
+    if (write(d->ep0, &descs, sizeof descs) != sizeof descs) die("Can't write %s descriptors: %s\n", path, strerror(errno));
+
+    struct
+    {
+        struct usb_functionfs_strings_head head;
+        uint16_t lang;
+        char name[16];
+    } __attribute__((packed)) strings =
+    {
+        .head = { htole32(FUNCTIONFS_STRINGS_MAGIC), htole32(sizeof strings), htole32(1), htole32(1) },
+        .lang = htole16(0x0409),
+    };
+    snprintf(strings.name, sizeof strings.name, "zerohid %s", d->name);
+    if (write(d->ep0, &strings, sizeof strings) != sizeof strings) die("Can't write %s strings: %s\n", path, strerror(errno));
+
+    // non-blocking, so io_submit() fails with EAGAIN until the host enables the
+    // endpoint rather than sleeping until then
+    snprintf(path, sizeof path, "%s/ep1", dir);
+    d->fd = open(path, O_RDWR | O_NONBLOCK);
+    if (d->fd < 0) die("Can't open %s: %s\n", path, strerror(errno));
+    expect(!fcntl(d->ep0, F_SETFL, O_NONBLOCK));
+    expect((d->done = eventfd(0, EFD_NONBLOCK)) >= 0);
+    expect(!io_setup(FFSDEPTH, &d->aio));
+    debug("hid %s is FunctionFS %s\n", d->name, dir);
+}
+
+// Bind the gadget to the first UDC, once every FunctionFS instance has its
+// descriptors
+void ffsbind(void)
+{
+    glob_t g;
+    if (glob("/sys/class/udc/*", 0, NULL, &g)) die("No UDC\n");
+    int fd = open(GADGET "/UDC", O_WRONLY);
+    if (fd < 0) die("Can't open %s: %s\n", GADGET "/UDC", strerror(errno));
+    const char *udc = strrchr(g.gl_pathv[0], '/') + 1;
+    if (write(fd, udc, strlen(udc)) < 0 && errno != EBUSY) die("Can't bind %s: %s\n", udc, strerror(errno));
+    close(fd);
+    globfree(&g);
+}
+
+// Submit report to the FunctionFS interrupt endpoint. Return 0 on success or
+// -1 if FFSDEPTH reports are already in flight or the gadget isn't connected
+// (errno tells which), die if error.
+int write_ffs(device *d, uint8_t *report)
+{
+    if (d->flying == FFSDEPTH)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    // buffers are used in turn, reports complete in order
+    uint8_t *b = d->buffer[d->submitted % FFSDEPTH];
+    memcpy(b, report, d->size);
+    struct iocb cb = { .aio_fildes = d->fd, .aio_lio_opcode = IOCB_CMD_PWRITE, .aio_buf = (uintptr_t)b,
+                       .aio_nbytes = d->size, .aio_flags = IOCB_FLAG_RESFD, .aio_resfd = d->done };
+    if (io_submit(d->aio, 1, (struct iocb *[]){ &cb }) == 1)
+    {
+        d->submitted++;
+        d->flying++;
+        return 0;
+    }
+    expect(errno == ESHUTDOWN || errno == ECONNRESET || errno == EAGAIN);
+    return -1;
+}
+
+// Reap completed reports, when the done eventfd is readable
+void ffsdone(device *d)
+{
+    uint64_t n;
+    if (read(d->done, &n, sizeof n) != sizeof n) return;
+    struct io_event ev[FFSDEPTH];
+    int r = io_getevents(d->aio, 0, FFSDEPTH, ev, &(struct timespec){0});
+    for (int i = 0; i < r; i++)
+    {
+        d->flying--;
+        if ((int64_t)ev[i].res < 0) debug("hid %s report failed: %s\n", d->name, strerror(-ev[i].res));
+        else taken(d, uS(), d->flying || queued(d));
+    }
+}
+
+// Handle FunctionFS events on the control endpoint, when it's readable. The
+// HID class requests are answered here, SET_REPORT carries the keyboard LEDs.
+void ffsevent(device *d)
+{
+    struct usb_functionfs_event ev[4];
+    int r = read(d->ep0, ev, sizeof ev);
+    if (r < 0) expect(errno == EAGAIN || errno == EINTR);
+    for (int i = 0; i < r / (int)sizeof ev[0]; i++)
+    {
+        if (ev[i].type == FUNCTIONFS_ENABLE || ev[i].type == FUNCTIONFS_DISABLE)
+            debug("hid %s %s\n", d->name, (ev[i].type == FUNCTIONFS_ENABLE) ? "enabled" : "disabled");
+        if (ev[i].type != FUNCTIONFS_SETUP) continue;
+
+        struct usb_ctrlrequest *c = &ev[i].u.setup;
+        int len = le16toh(c->wLength), value = le16toh(c->wValue);
+        const void *reply = NULL; // data for an IN request
+        int size = 0;
+        struct hiddesc hid = hiddesc(d);
+        uint8_t buf[64];
+        switch ((c->bRequestType << 8) | c->bRequest)
+        {
+            case ((USB_DIR_IN | USB_RECIP_INTERFACE) << 8) | USB_REQ_GET_DESCRIPTOR:
+                if ((value >> 8) == 0x22) reply = reportdesc(d, &size);
+                else if ((value >> 8) == 0x21) reply = &hid, size = sizeof hid;
+                break;
+            case ((USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x01: // GET_REPORT
+                reply = d->last, size = d->size;
+                break;
+            case ((USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x02: // GET_IDLE
+                reply = &d->idle, size = 1;
+                break;
+            case ((USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x03: // GET_PROTOCOL
+                reply = &d->protocol, size = 1;
+                break;
+            case ((USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x0A: // SET_IDLE
+                d->idle = value >> 8;
+                (void)!read(d->ep0, NULL, 0);
+                continue;
+            case ((USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x0B: // SET_PROTOCOL
+                d->protocol = value;
+                debug("hid %s %s protocol\n", d->name, value ? "report" : "boot");
+                (void)!read(d->ep0, NULL, 0);
+                continue;
+            case ((USB_TYPE_CLASS | USB_RECIP_INTERFACE) << 8) | 0x09: // SET_REPORT
+                if (len > sizeof buf) break;
+                if (read(d->ep0, buf, len) > 0)
+                {
+                    debug("hid %s output report %02X\n", d->name, buf[0]);
+                    if (d == &keyboard) ledreport(buf[0]);
+                }
+                continue;
+        }
+        if (reply) (void)!write(d->ep0, reply, (size < len) ? size : len);
+        else if (c->bRequestType & USB_DIR_IN) (void)!read(d->ep0, NULL, 0); // stall
+        else (void)!write(d->ep0, NULL, 0);
+    }
+}
+
+// io_uring backend, with -u. Reads from stdin and writes to hidg devices are
+// posted to the submission queue and all of them are submitted, and their
+// completions collected, by a single io_uring_enter() per pass of the event
+// loop, which also waits for the epoll fd. Up to FFSDEPTH reports per device
+// are in flight, all from the same submission and linked so they're written
+// in order. Each completes when the host takes it, or is cancelled by a linked
+// timeout at its deadline. Falls back to read() and write() if the kernel
+// doesn't have io_uring.
+enum { UREAD, UKEYBOARD, UMOUSE, UPOLL, UTIMEOUT }; // user_data of each kind of submission
+struct
+{
+    int fd;                     // -1 if not used
+    unsigned int *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int unsubmitted;   // submissions not yet passed to the kernel
+    bool reading;               // a read from stdin is in flight
+    bool polling;               // a poll of the epoll fd is in flight
+} uring = { .fd = -1 };
+
+static long io_uring_setup(unsigned entries, struct io_uring_params *p) { return syscall(__NR_io_uring_setup, entries, p); }
+static long io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+// Create the ring, return false if io_uring isn't available or is too old
+bool uringsetup(void)
+{
+    struct io_uring_params p = {0};
+    int fd = io_uring_setup(2 + 4*FFSDEPTH, &p);
+    if (fd < 0) return false;
+    // READ and WRITE at the current position (off = -1) need 5.6, which is
+    // also when RW_CUR_POS appeared. Older rings would fail every read.
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > size)
+        size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uint8_t *rings = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    expect(rings != MAP_FAILED);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    expect(uring.sqes != MAP_FAILED);
+    uring.sqtail = (unsigned int *)(rings + p.sq_off.tail);
+    uring.sqmask = (unsigned int *)(rings + p.sq_off.ring_mask);
+    uring.sqarray = (unsigned int *)(rings + p.sq_off.array);
+    uring.cqhead = (unsigned int *)(rings + p.cq_off.head);
+    uring.cqtail = (unsigned int *)(rings + p.cq_off.tail);
+    uring.cqmask = (unsigned int *)(rings + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    uring.fd = fd;
+    return true;
+}
+
+// Post a submission, return its index. The ring has room for one UREAD and
+// UPOLL and FFSDEPTH each of UKEYBOARD and UMOUSE in flight, each with a
+// UTIMEOUT.
+int post(uint8_t op, int fd, void *buf, unsigned int len, uint64_t data)
+{
+    unsigned int tail = *uring.sqtail, i = tail & *uring.sqmask;
+    uring.sqes[i] = (struct io_uring_sqe){ .opcode = op, .fd = fd, .addr = (uintptr_t)buf, .len = len,
+                                           .user_data = data };
+    if (op == IORING_OP_POLL_ADD) uring.sqes[i].poll32_events = EPOLLIN;
+    else if (op == IORING_OP_LINK_TIMEOUT) uring.sqes[i].timeout_flags = IORING_TIMEOUT_ABS;
+    else uring.sqes[i].off = -1; // current position
+    uring.sqarray[i] = i;
+    atomic_store_explicit((_Atomic unsigned int *)uring.sqtail, tail + 1, memory_order_release);
+    uring.unsubmitted++;
+    return i;
+}
+
+// Post a write of report n's buffer to the hidg device, linked to the
+// previous one, and if it has a deadline a timeout that cancels it then
+static void postwrite(device *d, unsigned int n)
+{
+    if (d->lastsqe >= 0) uring.sqes[d->lastsqe].flags |= IOSQE_IO_LINK;
+    d->lastsqe = post(IORING_OP_WRITE, d->wfd, d->buffer[n % FFSDEPTH], d->size, (d == &mouse) ? UMOUSE : UKEYBOARD);
+    d->flying++;
+    uint64_t due = d->due[n % FFSDEPTH];
+    if (!due) return;
+    struct __kernel_timespec *t = &d->expires[n % FFSDEPTH];
+    *t = (struct __kernel_timespec){ .tv_sec = due / 1000000, .tv_nsec = due % 1000000 * 1000 };
+    uring.sqes[d->lastsqe].flags |= IOSQE_IO_LINK;
+    d->lastsqe = post(IORING_OP_LINK_TIMEOUT, -1, t, 1, UTIMEOUT);
+}
+
+// Post the reports that failed again once the rest of their submission is
+// done, they still precede anything that's queued. Drop those that are past
+// their deadline, including one its timeout cancelled.
+void resend(device *d)
+{
+    if (d->flying) return;
+    for (; d->failed; d->failed--)
+    {
+        unsigned int n = d->resend++;
+        if (d->due[n % FFSDEPTH] && uS() >= d->due[n % FFSDEPTH])
+        {
+            debug("hid %s timeout\n", d->name);
+            stats.expired++;
+        }
+        else postwrite(d, n);
+    }
+}
+
+// Post report with deadline (or 0) to the hidg device. Return 0, or -1 with
+// EBUSY if reports from an earlier submission are still in flight, or FFSDEPTH
+// are. That's the ring's pipeline, the host's pace shows as how long reports
+// stay in flight rather than as the device blocking.
+int write_uring(device *d, uint8_t *report, uint64_t deadline)
+{
+    resend(d);
+    if (d->failed || d->flying == FFSDEPTH || (d->flying && d->lastsqe < 0))
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    unsigned int n = d->submitted++;
+    memcpy(d->buffer[n % FFSDEPTH], report, d->size);
+    d->due[n % FFSDEPTH] = deadline;
+    postwrite(d, n);
+    return 0;
+}
+
+// Submit what's been posted, wait for at least one completion unless busy,
+// and handle the completions. Set *eof at EOF on stdin. Return true if the
+// epoll fd is ready.
+bool uringwait(bool busy, bool *eof)
+{
+    int r = io_uring_enter(uring.fd, uring.unsubmitted, busy ? 0 : 1, IORING_ENTER_GETEVENTS);
+    if (r < 0)
+    {
+        expect(errno == EINTR);
+        checkstats();
+        return false;
+    }
+    uring.unsubmitted -= r;
+    keyboard.lastsqe = mouse.lastsqe = -1;
+
+    bool ready = false;
+    unsigned int head = *uring.cqhead;
+    while (head != atomic_load_explicit((_Atomic unsigned int *)uring.cqtail, memory_order_acquire))
+    {
+        struct io_uring_cqe *c = &uring.cqes[head++ & *uring.cqmask];
+        switch (c->user_data)
+        {
+            case UREAD:
+                uring.reading = false;
+                if (c->res > 0)
+                {
+                    inhead += c->res;
+                    stats.reads++;
+                    stats.bytes += c->res;
+                }
+                else if (!c->res) *eof = true;
+                else if (c->res != -EINTR && c->res != -EAGAIN) die("Can't read stdin: %s\n", strerror(-c->res));
+                break;
+            case UKEYBOARD:
+            case UMOUSE:
+            {
+                // writes complete in order, a write that's blocked in the
+                // kernel can be interrupted or time out and then the rest of
+                // its chain is cancelled, resend() sorts those out
+                device *d = (c->user_data == UMOUSE) ? &mouse : &keyboard;
+                unsigned int n = d->submitted - d->flying--;
+                if (c->res == -EINTR || c->res == -ECANCELED)
+                {
+                    if (!d->failed++) d->resend = n;
+                }
+                else if (c->res < 0) debug("hid %s report failed: %s\n", d->name, strerror(-c->res));
+                else taken(d, uS(), d->flying || queued(d));
+                break;
+            }
+            case UPOLL:
+                if (c->res < 0) die("Can't poll epoll with io_uring: %s\n", strerror(-c->res));
+                uring.polling = false;
+                ready = true;
+                break;
+            case UTIMEOUT:
+                break; // its write says whether it fired
+        }
+    }
+    atomic_store_explicit((_Atomic unsigned int *)uring.cqhead, head, memory_order_release);
+    return ready;
+}
+
+// Write report to the device with its backend, io_uring drops it in flight at
+// its deadline
+#define put(d, report, deadline) (((d)->ep0 >= 0) ? write_ffs(d, report) : \
+                                  (uring.fd >= 0) ? write_uring(d, report, deadline) : write_hid((d)->fd, report, (d)->size))
+
+// Write queued reports to the device until it blocks or it's not time for the
+// next report, dropping any that are past their deadline. Then update the
+// device's epoll events, we always want host output reports and want to know
+// when the device is writable if anything can be written.
+void flush(device *d, int ep)
+{
+    uint64_t now = uS();
+    if (now >= d->retry) d->retry = 0;
+    while (queued(d) && configured && !d->retry && now >= d->next && !awaitingack(d))
+    {
+        unsigned int i = d->tail & (QSIZE-1);
+        if (d->queue[i].deadline && now >= d->queue[i].deadline)
+        {
+            debug("hid %s timeout\n", d->name);
+            stats.expired++;
+            d->tail++;
+            continue;
+        }
+        if (put(d, d->queue[i].report, d->queue[i].deadline))
+        {
+            if (errno == ESHUTDOWN || errno == ECONNRESET)
+            {
+                // gadget isn't connected, the UDC state will tell us when it
+                // is but try again in 100 mS in case we missed it
+                debug("hid %s shut down\n", d->name);
+                d->retry = now + 100000;
+                d->blocked = 0;
+                d->backed = false;
+                break;
+            }
+            if (errno == EBUSY) break; // the ring's pipeline is full, not the host
+            // not ready
+            if (!d->blocked)
+            {
+                d->blocked = now;
+                stats.blocked++;
+            }
+            break;
+        }
+        if (d->blocked)
+        {
+            uint64_t waited = uS() - d->blocked;
+            stats.resumed++;
+            stats.resume += waited;
+            if (waited > stats.maxresume) stats.maxresume = waited;
+            d->blocked = 0;
+            if (learn && !pace.file && d->written)
+            {
+                // the host just took a report after we were blocked, so the
+                // time since the last one is about the poll interval
+                uint32_t gap = now - d->written;
+                if (gap < 125) gap = 125; // high speed microframe
+                if (!d->interval || gap < d->interval)
+                {
+                    d->interval = gap;
+                    debug("hid %s interval %u uS\n", d->name, gap);
+                }
+            }
+        }
+        // with FunctionFS and io_uring the host takes it when it completes
+        if (d->ep0 < 0 && uring.fd < 0) taken(d, now, queued(d) > 1);
+        memcpy(d->last, d->queue[i].report, d->size);
+        d->written = now;
+        if (d->interval) d->next = now + d->interval;
+        if (enumerated)
+        {
+            debug("hid %s first report %llu uS after configuration\n", d->name, (unsigned long long)(now - enumerated));
+            enumerated = 0;
+        }
+        d->tail++;
+        if (d == &keyboard && pace.file) paced();
+    }
+
+    uint32_t events = EPOLLIN | (queued(d) && configured && !d->retry && now >= d->next && !awaitingack(d) ? EPOLLOUT : 0);
+    if (events != d->events && !d->plain && d->ep0 < 0 && uring.fd < 0)
+    {
+        watch(ep, EPOLL_CTL_MOD, d->fd, events);
+        d->events = events;
+    }
+}
+
+// Read a host output report from device (e.g. keyboard LEDs)
+void output(device *d)
+{
+    uint8_t report[8];
+    int r = read(d->fd, report, sizeof report);
+    if (r < 0) expect(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ESHUTDOWN);
+    if (r <= 0) return;
+    debug("hid %s output report %02X\n", d->name, report[0]);
+    if (d == &keyboard) ledreport(report[0]);
+}
+
+// Arm timerfd to expire at absolute monotonic uS, or disarm if 0
+void settimer(int fd, uint64_t when)
+{
+    struct itimerspec t = { .it_value = { .tv_sec = when / 1000000, .tv_nsec = (when % 1000000) * 1000 } };
+    expect(!timerfd_settime(fd, TFD_TIMER_ABSTIME, &t, NULL));
+}
+
+// Open the first UDC's state attribute, or return -1 if there isn't one
+int openudc(void)
+{
+    glob_t g;
+    int fd = -1;
+    if (!glob("/sys/class/udc/*/state", 0, NULL, &g))
+    {
+        fd = open(g.gl_pathv[0], O_RDONLY);
+        if (fd >= 0) debug("Watching %s\n", g.gl_pathv[0]);
+        globfree(&g);
+    }
+    return fd;
+}
+
+// Read UDC state and update configured. When the host configures the gadget,
+// queued reports get fresh deadlines and are flushed by the event loop.
+void udcstate(int udc, device **devs)
+{
+    char state[32];
+    int r = pread(udc, state, sizeof state - 1, 0);
+    expect(r >= 0);
+    state[r] = 0;
+    bool now = !strcmp(state, "configured\n");
+    if (now == configured) return;
+    configured = now;
+    debug("udc %s", state);
+    uint64_t t = uS();
+    for (int d = 0; d < 2; d++)
+    {
+        devs[d]->blocked = devs[d]->retry = 0;
+        if (configured)
+            for (unsigned int i = devs[d]->tail; i != devs[d]->head; i++)
+                devs[d]->queue[i & (QSIZE-1)].deadline = expiry(devs[d], t);
+    }
+    if (configured) enumerated = t;
+}
+
+// The event loop. Wait for stdin (or the reader thread), writable hid devices,
+// host output reports and timers, and do whatever can be done without
+// blocking on any one of them. Return on EOF once everything is written.
+void loop(void)
+{
+    int ep = epoll_create1(0);
+    expect(ep >= 0);
+
+    int input = threaded ? evring.ready : 0;   // stdin or the reader thread's eventfd
+    bool ringin = !threaded && uring.fd >= 0;  // stdin is read with io_uring instead
+    uint32_t inevents = ringin ? 0 : EPOLLIN;
+    bool plain = !ringin && !watch(ep, EPOLL_CTL_ADD, input, inevents);
+
+    device *devs[] = { &keyboard, &mouse };
+    for (int i = 0; i < 2; i++) if (devs[i]->fd >= 0)
+    {
+        devs[i]->events = EPOLLIN;
+        if (devs[i]->ep0 >= 0)
+        {
+            // FunctionFS, watch for control events and completed reports
+            watch(ep, EPOLL_CTL_ADD, devs[i]->ep0, EPOLLIN);
+            watch(ep, EPOLL_CTL_ADD, devs[i]->done, EPOLLIN);
+        }
+        else devs[i]->plain = !watch(ep, EPOLL_CTL_ADD, devs[i]->fd, EPOLLIN);
+    }
+
+    // timer for report deadlines
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    expect(timer >= 0);
+    watch(ep, EPOLL_CTL_ADD, timer, EPOLLIN);
+    uint64_t armed = 0;
+
+    // and for mouse glide steps
+    glidetimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    expect(glidetimer >= 0);
+    watch(ep, EPOLL_CTL_ADD, glidetimer, EPOLLIN);
+
+    // The UDC notifies state changes with EPOLLPRI
+    int udc = openudc();
+    if (udc >= 0)
+    {
+        watch(ep, EPOLL_CTL_ADD, udc, EPOLLPRI);
+        configured = false;
+        udcstate(udc, devs);
+    }
+
+    bool eof = false;
+    bool drained = true;    // false if input stalled because the keyboard queue was full
+    while (true)
+    {
+        // don't sleep if there's work for a plain file, or if input stalled
+        // and the queues have since been flushed
+        bool busy = plain && inevents;
+        for (int d = 0; d < 2; d++) busy |= devs[d]->plain && queued(devs[d]) && uring.fd < 0;
+        busy |= !drained && QSIZE - queued(&keyboard) >= MAXSEND;
+        for (int d = 0; d < 2; d++) busy |= devs[d]->failed && !devs[d]->flying; // for resend()
+
+        struct epoll_event evs[8];
+        int n = 0;
+        if (uring.fd >= 0)
+        {
+            // wait in the ring, epoll is just another submission
+            unsigned int offset = inhead & (INSIZE-1);
+            unsigned int space = INSIZE - pending();
+            if (space > INSIZE - offset) space = INSIZE - offset;
+            if (ringin && !eof && space && !uring.reading)
+            {
+                // keep a read posted while there's space in the input ring
+                post(IORING_OP_READ, 0, inring + offset, space, UREAD);
+                uring.reading = true;
+            }
+            for (int d = 0; d < 2; d++) if (devs[d]->fd >= 0) resend(devs[d]);
+            if (!uring.polling)
+            {
+                post(IORING_OP_POLL_ADD, ep, NULL, 0, UPOLL);
+                uring.polling = true;
+            }
+            if (uringwait(busy, &eof)) n = epoll_wait(ep, evs, 8, 0);
+        }
+        else n = epoll_wait(ep, evs, 8, busy ? 0 : -1);
+        if (n < 0)
+        {
+            expect(errno == EINTR);
+            checkstats();
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            int fd = evs[i].data.fd;
+            if (fd == input)
+            {
+                if (threaded)
+                {
+                    uint64_t u;
+                    (void)!read(input, &u, sizeof u);  // just clear it
+                    eof = atomic_load(&evring.eof);
+                }
+                else if (!fill()) eof = true;
+            }
+            else if (fd == udc) udcstate(udc, devs);
+            else if (fd == timer)
+            {
+                uint64_t u;
+                (void)!read(timer, &u, sizeof u);
+                armed = 0;
+            }
+            else if (fd == glidetimer)
+            {
+                uint64_t u;
+                if (read(glidetimer, &u, sizeof u) == sizeof u && glidestart) glidestep(false);
+            }
+            else
+            {
+                for (int d = 0; d < 2; d++) if (devs[d]->ep0 >= 0)
+                {
+                    if (fd == devs[d]->ep0) ffsevent(devs[d]);
+                    if (fd == devs[d]->done) ffsdone(devs[d]);
+                }
+                else if (fd == devs[d]->fd)
+                {
+                    if (evs[i].events & (EPOLLERR|EPOLLHUP)) die("hid %s hung up\n", devs[d]->name);
+                    if (evs[i].events & EPOLLIN) output(devs[d]);
+                }
+            }
+        }
+
+        if (plain && inevents && !fill()) eof = true;
+
+        // decode as much input as the queues will hold
+        if (threaded)
+        {
+            drained = pull();
+            if (drained)
+            {
+                // tell reader to wake us, but check again in case we missed it
+                atomic_store(&evring.writerwait, true);
+                drained = pull();
+            }
+        } else
+        {
+            decode();
+            drained = !pending();
+        }
+
+        // keyboard first, the mouse never delays it
+        uint64_t deadline = ackwait(uS()); // earliest deadline of a blocked report, retry or probe
+        probe();
+        for (int d = 0; d < 2; d++) if (devs[d]->fd >= 0)
+        {
+            flush(devs[d], ep);
+            uint64_t t = devs[d]->retry;
+            if (!t && configured && queued(devs[d]))
+            {
+                // wake for the next slot, or to drop the oldest report
+                t = devs[d]->next;
+                if (t <= uS()) t = devs[d]->queue[devs[d]->tail & (QSIZE-1)].deadline;
+            }
+            if (t && (!deadline || t < deadline)) deadline = t;
+        }
+        if (!queued(&keyboard) && !pacing()) savepace();
+        if (!threaded && escdeadline && room() && (!deadline || escdeadline < deadline)) deadline = escdeadline;
+        // a later wakeup than needed is harmless, so the timer is only moved
+        // earlier, saving a syscall for each report that's queued briefly
+        if (deadline && (!armed || deadline < armed)) settimer(timer, armed = deadline);
+
+        if (eof)
+        {
+            if (!threaded && drained && (escdeadline || vtleft()) && room()) vtflush(true);
+            if (drained && (threaded || (!escdeadline && !vtleft())) && !glidestart && !queued(&keyboard) && !queued(&mouse) &&
+                !keyboard.flying && !mouse.flying &&
+                !keyboard.failed && !mouse.failed && !pacing()) return;
+            if (!threaded && inevents)
+            {
+                // stop watching stdin, it's always readable at EOF
+                if (!plain) watch(ep, EPOLL_CTL_DEL, 0, 0);
+                inevents = 0;
+            }
+        }
+        else if (!threaded && !ringin)
+        {
+            // only watch stdin if there's space in the input ring
+            uint32_t want = (pending() < INSIZE) ? EPOLLIN : 0;
+            if (want != inevents)
+            {
+                if (!plain) watch(ep, EPOLL_CTL_MOD, 0, want);
+                inevents = want;
+            }
+        }
+    }
+}
+
+// Pin the calling thread to specified cpu, if not -1
+static void pin(pthread_t thread, int cpu)
+{
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int e = pthread_setaffinity_np(thread, sizeof set, &set);
+    if (e) die("Can't pin to cpu %d: %s\n", cpu, strerror(e));
+}
+
+#ifndef BENCHMARK
+int main(int argc, char *argv[])
+{
+    int rcpu = -1, wcpu = -1;   // reader and writer cpus
+
+    while(true) switch(getopt(argc, argv, ":abcde:fi:kl:no:p:rtuv:w:x"))
+    {
+        case 'a': mode = 2; break;
+        case 'b': mode = 3; break;
+        case 'c': compile = true; break;
+        case 'd': dodebug = true; break;
+        case 'e': expire = strtoul(optarg, NULL, 10); break;
+        case 'f': fast = true; break;
+        case 'i':
+            if (!strcmp(optarg, "auto")) learn = true;
+            else interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'k': nkro = true; break;
+        case 'l': loadlayout(optarg); break;
+        case 'n': offline = true; break;
+        case 'o':
+            if (!strcmp(optarg, "block")) policy = BLOCK;
+            else if (!strcmp(optarg, "oldest")) policy = OLDEST;
+            else if (!strcmp(optarg, "newest")) policy = NEWEST;
+            else if (!strcmp(optarg, "coalesce")) policy = COALESCE;
+            else usage();
+            break;
+        case 'p':
+            if (sscanf(optarg, "%d,%d", &rcpu, &wcpu) != 2) usage();
+            threaded = true;
+            break;
+        case 'r': mode = 4; break;
+        case 't': threaded = true; break;
+        case 'u': useuring = true; break;
+        case 'v': escwait = strtoul(optarg, NULL, 10); break;
+        case 'w': pace.file = optarg; break;
+        case 'x': mode = 1; break;
+        case ':':            // missing
+        case '?': usage();   // or invalid options
+        case -1: goto optx;  // no more options
+    } optx:
+    argc -= (optind-1);
+    argv += (optind-1);
+    if (compile ? argc != 1 || mode == 4 : argc < 2 || argc > 3) usage();
+
+    debug("Starting zerohid in %s mode\n", (mode==0)?"auto":(mode==1)?"xkb":(mode==2)?"ascii":(mode==3)?"binary":"raw");
+
+    keyboard.interval = mouse.interval = interval;
+    if (nkro) keyboard.size = 17;
+    if (pace.file && !compile)
+    {
+        loadpace();
+        atexit(savepace);
+    }
+
+    if (compile)
+    {
+        // just decode stdin to stdout
+        while (fill()) decode();
+        vtflush(true);
+        return 0;
+    }
+
+    if (useuring && !uringsetup()) debug("io_uring isn't available\n");
+
+    // a directory is a FunctionFS mount, see ffsopen()
+    device *devs[] = { &keyboard, &mouse };
+    bool ffs = false;
+    for (int d = 0; d < argc - 1; d++)
+    {
+        struct stat st;
+        if (!stat(argv[d+1], &st) && S_ISDIR(st.st_mode))
+        {
+            ffsopen(devs[d], argv[d+1]);
+            ffs = true;
+            continue;
+        }
+        devs[d]->fd = open(argv[d+1], O_RDWR|O_NONBLOCK);
+        if (devs[d]->fd <= 0) die("Can't open %s: %s\n", argv[d+1], strerror(errno));
+        if (uring.fd >= 0)
+        {
+            // io_uring waits for blocking writes, non-blocking ones just fail
+            devs[d]->wfd = open(argv[d+1], O_WRONLY);
+            if (devs[d]->wfd < 0) die("Can't open %s: %s\n", argv[d+1], strerror(errno));
+        }
+    }
+    if (ffs) ffsbind();
+
+    if (isatty(0))
+    {
+        // put stdin tty in raw mode
+        struct termios t;
+        expect(!tcgetattr(0, &t));          // get current
+        saveattr = t;                       // save a copy
+        t.c_lflag &= ~(ICANON|ECHO|ISIG);   // make raw
+        if (mode >= 3) t.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL|IXON); // all 8 bits, untranslated
+        if (layout) t.c_iflag &= ~ISTRIP;   // UTF-8 needs all 8 bits
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(0, TCSANOW, &t);
+        atexit(restore);                    // restore tty on exit
+    }
+
+    // SIGUSR1 dumps stats, without SA_RESTART so a blocked read() notices
+    sigaction(SIGUSR1, &(struct sigaction){ .sa_handler = usr1 }, NULL);
+    if (dodebug) atexit(showstats);
+
+    if (threaded)
+    {
+        // Reader thread decodes stdin, this thread runs the event loop
+        expect((evring.space = eventfd(0, 0)) >= 0);
+        expect((evring.ready = eventfd(0, EFD_NONBLOCK)) >= 0);
+        atomic_store(&evring.writerwait, true); // the event loop starts out waiting
+        pthread_t thread;
+        int e = pthread_create(&thread, NULL, reader, NULL);
+        if (e) die("Can't create reader thread: %s\n", strerror(e));
+        pin(thread, rcpu);
+        pin(pthread_self(), wcpu);
+    }
+
+    loop();
+    die("EOF on stdin\n");
+}
+#else
+// Microbenchmark for the xkb decoder, run with "make bench". Decodes a
+// synthetic stream of key and mouse lines with the byte-at-a-time splitter and
+// sscanf() parser that decode() used to have, then with decode() itself, and
+// prints events per second for each. Reports are compiled to /dev/null.
+
+// Old line parser
+void oldxkb(char *s, int got)
+{
+    if (s[0] == '+' || s[0] == '-')
+    {
+        struct { bool down; uint16_t key; } chord[LINESIZE/2];
+        int count = 0;
+        for (char *p = s; *p; count++)
+        {
+            int n;
+            if ((*p != '+' && *p != '-') || sscanf(p+1, "%hu %n", &chord[count].key, &n) != 1) return;
+            chord[count].down = (*p == '+');
+            p += n+1;
+        }
+        bool changed = false;
+        for (int i = 0; i < count; i++) changed |= xchange(pressed, chord[i].down, chord[i].key) > 0;
+        if (changed) send(&keyboard, pressed);
+    }
+    else if (s[0] >= '0' && s[0] <= '7')
+    {
+        uint16_t X, Y;
+        int8_t W = 0;
+        int n;
+        int r = sscanf(s+1, "%hu %hu %hhd %n", &X, &Y, &W, &n);
+        if (r != 3 || X > 32767 || Y > 32767 || W < -127 || s[n+1]) return;
+        xmouse(s[0]-'0', X, Y, W);
+    }
+}
+
+// Old splitter
+void olddecode(void)
+{
+    static char s[LINESIZE];
+    static int got = 0;
+
+    while (pending())
+    {
+        uint8_t c = inring[intail++ & (INSIZE-1)];
+        if (c == '\n')
+        {
+            s[got] = 0;
+            oldxkb(s, got);
+            got = 0;
+        }
+        else if (c >= ' ' && c <= '~' && got < sizeof(s)-1) s[got++] = c;
+    }
+}
+
+// Feed size bytes of data through the input ring to decoder, return events per
+// second
+double run(void (*decoder)(void), char *data, size_t size, int events)
+{
+    uint64_t start = uS();
+    for (size_t i = 0; i < size;)
+    {
+        unsigned int offset = inhead & (INSIZE-1);
+        unsigned int space = INSIZE - pending();
+        if (space > INSIZE - offset) space = INSIZE - offset;
+        if (space > size - i) space = size - i;
+        memcpy(inring + offset, data + i, space);
+        inhead += space;
+        i += space;
+        decoder();
+    }
+    return events * 1e6 / (uS() - start);
+}
+
+int main(void)
+{
+    // one million events, mostly keys
+    int events = 1000000;
+    char *data = malloc(events * 20), *p = data;
+    expect(data);
+    srandom(1);
+    for (int i = 0; i < events; i++)
+    {
+        if (random() % 4)
+            p += sprintf(p, "%c%ld\n", (i & 1) ? '-' : '+', 'a' + random() % 26);
+        else
+            p += sprintf(p, "%ld %ld %ld %ld\n", random() % 8, random() % 32768, random() % 32768, random() % 255 - 127);
+    }
+
+    mode = 1;
+    compile = true;
+    expect(freopen("/dev/null", "w", stdout));
+    for (int pass = 0; pass < 3; pass++)
+    {
+        double before = run(olddecode, data, p - data, events);
+        double after = run(decode, data, p - data, events);
+        fprintf(stderr, "sscanf: %.0f events/sec, decode: %.0f events/sec, %.1fx\n", before, after, after/before);
+    }
+    return 0;
 }
+#endif
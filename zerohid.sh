@@ -9,25 +9,90 @@ die() { echo "$*" >&2; exit 1; }
 
   # If "ascii", convert plain ASCII characters to HID scan codes.
   # If "xkb", convert X key codes to HID scan codes.
+  # If "binary", as xkb but events are sent as CRC-checked binary frames.
+  # If "raw", send pre-compiled HID reports, see "zerohid -c".
   # Otherwise, start in xkb mode but revert to ascii if an empty line is received.
   mode=ascii
 
+  # If "yes", hold keys between ASCII characters to minimize HID reports.
+  fast=no
+
+  # If set, in ascii mode read UTF-8 and type it per this host keyboard layout,
+  # one of the compiled layouts in layouts/: us, uk, de or fr.
+  layout=
+
+  # If set, in ascii mode type VT100/xterm escape sequences for cursor, editing
+  # and function keys as the key they represent. A lone ESC is typed if the rest
+  # of a sequence doesn't arrive within this many milliseconds.
+  escape=
+
+  # If "yes", read the serial port and write HID reports in separate threads.
+  # Set to "R,W" to also pin the reader and writer threads to cpus R and W.
+  threads=no
+
+  # If "yes", read the serial port and write HID reports with io_uring, which
+  # takes far fewer syscalls per report. Ignored if the kernel doesn't have it.
+  uring=no
+
+  # What to do when the keyboard report queue is full: block, oldest, newest or
+  # coalesce. The mouse queue always coalesces. See "zerohid -h".
+  overflow=block
+
+  # Drop HID reports that haven't been written within this many milliseconds,
+  # 0 means never.
+  expire=1000
+
+  # If "drop", discard HID reports while the USB host hasn't configured the
+  # gadget. Otherwise buffer them and send when it does.
+  offline=buffer
+
+  # If set, write at most one HID report per this many microseconds, merging
+  # reports that arrive in between. Set to the endpoint poll interval, or
+  # "auto" to learn it. A number also sets the endpoints' poll interval.
+  interval=
+
+  # If set, pace the keyboard for a target that loses keys typed too fast,
+  # using Num Lock round trips, and keep what's learned about it under this
+  # name. See "zerohid -h".
+  pacing=
+
+  # If "yes", create a high speed gadget with a 64-byte control endpoint and a
+  # 125 uS poll interval unless "interval" is set, so bulk typing runs at up to
+  # 8000 reports per second. The rate actually achieved is in the debug stats.
+  highspeed=no
+
   # If "yes", write debug info to the serial port.
   debug=yes
 
   # If "yes", also support 3-button mouse in xkb mode
   mouse=no
 
+  # If "yes", use N-key rollover keyboard reports instead of the 6-key boot
+  # report. Not all hosts support it.
+  nkro=no
+
+  # If "yes", zerohid implements the HID function itself over FunctionFS
+  # instead of using the kernel's, with several reports in flight and the
+  # endpoint poll interval taken from "interval".
+  functionfs=no
+
 # Devices of interest
 serial=/dev/ttyS0
 hidk=/dev/hidg0
 hidm=/dev/hidg1
+[[ $functionfs == yes ]] && hidk=/dev/ffs-keyboard hidm=/dev/ffs-mouse
 
 [[ -e $serial ]] || die "No device $serial"
 stty 115200 cs8 -cstopb -parenb -ixon < $serial
 
 cmd=${0%/*}/hid.sh
 [[ $mouse == yes ]] && cmd+=" -m"
+[[ $nkro == yes ]] && cmd+=" -k"
+[[ $functionfs == yes ]] && cmd+=" -f"
+[[ $highspeed == yes ]] && cmd+=" -s"
+# zerohid sets the FunctionFS poll interval itself
+[[ $highspeed == yes && $functionfs == yes && ! $interval ]] && interval=125
+[[ $interval =~ ^[0-9]+$ && $functionfs != yes ]] && cmd+=" -i $interval"
 echo "Running '$cmd'"
 eval $cmd || die "HID initialization failed"
 [[ -e $hidk ]] || die "No device $hidk"
@@ -36,7 +101,20 @@ eval $cmd || die "HID initialization failed"
 cmd="${0%/*}/zerohid"
 [[ $mode == ascii ]] && cmd+=" -a"
 [[ $mode == xkb ]] && cmd+=" -x"
+[[ $mode == binary ]] && cmd+=" -b"
+[[ $mode == raw ]] && cmd+=" -r"
 [[ $debug == yes ]] && cmd+=" -d"
+[[ $nkro == yes ]] && cmd+=" -k"
+[[ $fast == yes ]] && cmd+=" -f"
+[[ $layout ]] && cmd+=" -l ${0%/*}/layouts/$layout.kbd"
+[[ $escape ]] && cmd+=" -v $escape"
+[[ $threads == yes ]] && cmd+=" -t"
+[[ $threads == *,* ]] && cmd+=" -p $threads"
+[[ $uring == yes ]] && cmd+=" -u"
+cmd+=" -o $overflow -e $expire"
+[[ $offline == drop ]] && cmd+=" -n"
+[[ $interval ]] && cmd+=" -i $interval"
+[[ $pacing ]] && mkdir -p /var/lib/zerohid && cmd+=" -w /var/lib/zerohid/$pacing"
 cmd+=" $hidk"
 [[ $mouse == yes ]] && cmd+=" $hidm"
 cmd+=" <$serial"